@@ -0,0 +1,95 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : bench.h
+  * @brief          : Header for bench.c file.
+  *                   LIDAR throughput and latency benchmark, reported on USART3.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "stm32f0xx_hal.h"
+#include <stdint.h>
+/* USER CODE END Includes */
+
+/* Exported types ------------------------------------------------------------*/
+/* USER CODE BEGIN ET */
+typedef struct
+{
+	uint32_t samples_per_s;
+	uint32_t latency_min; // t_complete - t_trigger, us
+	uint32_t latency_mean;
+	uint32_t latency_p99; // over the first BENCH_MAX_SAMPLES samples
+	uint32_t latency_max;
+	uint32_t i2c_errors; // NACKs, timeouts, arbitration losses and bus errors on the LIDAR bus
+	uint32_t acq_errors; // samples the acquisition gave up on
+	uint32_t errors_per_1000; // (i2c_errors + acq_errors) per 1000 samples
+	uint32_t cpu_percent; // share of the main loop not spent idle
+} bench_result_t;
+/* USER CODE END ET */
+
+/* Exported constants --------------------------------------------------------*/
+/* USER CODE BEGIN EC */
+// Build with -DBENCH_MODE=1 (or set it here) to have main() run every
+// strategy once and report over USART3 instead of starting the application.
+#ifndef BENCH_MODE
+#define BENCH_MODE 0
+#endif
+
+// acquisition strategies, in the order bench_run_all() reports them
+#define BENCH_BLOCKING 0 // lidar_get_sample() in a loop
+#define BENCH_TRIGGERED 1 // TIM7 triggers, bias corrected every LIDAR_BIAS_INTERVAL_DEFAULT samples
+#define BENCH_TRIGGERED_BIAS 2 // TIM7 triggers, bias corrected every sample
+#define BENCH_READY_PIN 3 // TIM7 triggers, MODE pin on LIDAR_READY_PIN instead of busy polls
+#define BENCH_CONTINUOUS 4 // sensor repeats on its own, TIM7 only reads
+#define BENCH_STRATEGIES 5
+
+#define BENCH_DURATION_MS 2000 // per strategy
+#define BENCH_RATE_HZ 1000 // requested rate, above what the sensor delivers so it runs flat out
+#define BENCH_MAX_SAMPLES 1024 // latencies kept for the percentile
+/* USER CODE END EC */
+
+/* Exported macro ------------------------------------------------------------*/
+/* USER CODE BEGIN EM */
+
+/* USER CODE END EM */
+
+/* Exported functions prototypes ---------------------------------------------*/
+/* USER CODE BEGIN EFP */
+void bench_run(uint8_t strategy, bench_result_t* presult);
+void bench_report(uint8_t strategy, const bench_result_t* presult);
+void bench_run_all(void);
+/* USER CODE END EFP */
+
+/* Private defines -----------------------------------------------------------*/
+/* USER CODE BEGIN Private defines */
+
+/* USER CODE END Private defines */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BENCH_H */
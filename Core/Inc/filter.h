@@ -0,0 +1,123 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : filter.h
+  * @brief          : Header for filter.c file.
+  *                   Integer-only filter chain for LIDAR distances.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FILTER_H
+#define __FILTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "stm32f0xx_hal.h"
+#include <stdint.h>
+/* USER CODE END Includes */
+
+/* Exported types ------------------------------------------------------------*/
+/* USER CODE BEGIN ET */
+typedef struct filter_chain filter_chain_t; // defined after the constants it is sized with
+
+typedef struct
+{
+	uint32_t median_cycles; // mean cycles per sample of each stage alone
+	uint32_t ema_cycles;
+	uint32_t kalman_cycles;
+	uint32_t chain_cycles; // all three plus the chain bookkeeping
+	uint32_t chain_max_cycles; // worst single sample of the full chain
+} filter_bench_t;
+/* USER CODE END ET */
+
+/* Exported constants --------------------------------------------------------*/
+/* USER CODE BEGIN EC */
+// stages, applied in this order
+#define FILTER_MEDIAN 0x01 // median of the last median_n samples, rejects single spikes
+#define FILTER_EMA 0x02 // y += (x - y) >> ema_shift
+#define FILTER_KALMAN 0x04 // 1-D random walk Kalman filter
+#define FILTER_ALL (FILTER_MEDIAN | FILTER_EMA | FILTER_KALMAN)
+
+#define FILTER_MEDIAN_MAX 9 // longest median window
+#define FILTER_MEDIAN_N_DEFAULT 5
+#define FILTER_EMA_SHIFT_DEFAULT 2 // alpha = 1/4
+#define FILTER_KALMAN_Q_DEFAULT 64 // process noise, cm^2 in Q8 (0.25)
+#define FILTER_KALMAN_R_DEFAULT 1024 // measurement noise, cm^2 in Q8 (4)
+#define FILTER_KALMAN_P_MAX 0x7FFF // keeps P << 16 inside 32 bits
+
+#define FILTER_BENCH_SAMPLES 256 // synthetic samples per stage in filter_test_cycles()
+
+// State of one filter chain, one per sensor. Distances are cm; the EMA and
+// Kalman states are Q16 so the fractional part survives between samples.
+struct filter_chain
+{
+	uint8_t stages; // FILTER_MEDIAN | FILTER_EMA | FILTER_KALMAN
+	uint8_t decimate; // one output per this many inputs, 1 = every input
+	uint8_t decimate_count;
+
+	uint8_t median_n; // odd, at most FILTER_MEDIAN_MAX
+	uint8_t median_pos; // next slot of median_window to overwrite
+	uint8_t median_fill;
+	uint16_t median_window[FILTER_MEDIAN_MAX]; // in arrival order
+	uint16_t median_sorted[FILTER_MEDIAN_MAX]; // same values, ascending
+
+	uint8_t ema_shift;
+	uint8_t ema_primed;
+	int32_t ema_q16;
+
+	uint8_t kalman_primed;
+	int32_t kalman_x_q16; // estimate
+	uint32_t kalman_p_q8; // estimate variance
+	uint32_t kalman_q_q8;
+	uint32_t kalman_r_q8;
+};
+/* USER CODE END EC */
+
+/* Exported macro ------------------------------------------------------------*/
+/* USER CODE BEGIN EM */
+
+/* USER CODE END EM */
+
+/* Exported functions prototypes ---------------------------------------------*/
+/* USER CODE BEGIN EFP */
+void filter_init(filter_chain_t *f, uint8_t stages, uint8_t decimate);
+void filter_set_median(filter_chain_t *f, uint8_t n);
+void filter_set_ema(filter_chain_t *f, uint8_t shift);
+void filter_set_kalman(filter_chain_t *f, uint16_t q_q8, uint16_t r_q8);
+uint8_t filter_apply(filter_chain_t *f, uint16_t in, uint16_t *pout); // returns 1 if *pout is a new output
+
+uint16_t filter_median(filter_chain_t *f, uint16_t in);
+uint16_t filter_ema(filter_chain_t *f, uint16_t in);
+uint16_t filter_kalman(filter_chain_t *f, uint16_t in);
+
+void filter_test_cycles(filter_bench_t *presult); // SysTick cycle counts per stage
+/* USER CODE END EFP */
+
+/* Private defines -----------------------------------------------------------*/
+/* USER CODE BEGIN Private defines */
+
+/* USER CODE END Private defines */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FILTER_H */
@@ -0,0 +1,102 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : fusion.h
+  * @brief          : Header for fusion.c file.
+  *                   LIDAR + IMU range, range-rate and tilt estimates.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FUSION_H
+#define __FUSION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "stm32f0xx_hal.h"
+#include "imu.h"
+#include <stdint.h>
+/* USER CODE END Includes */
+
+/* Exported types ------------------------------------------------------------*/
+/* USER CODE BEGIN ET */
+typedef struct
+{
+	uint16_t range; // cm
+	int16_t rate; // cm/s, negative while closing in
+	int16_t pitch; // centidegrees, nose up positive
+	int16_t roll; // centidegrees, right side down positive
+	uint32_t t; // timebase_us() of the IMU sample the estimate is for
+} fusion_state_t;
+
+typedef struct
+{
+	uint32_t imu_updates;
+	uint32_t lidar_updates;
+	uint32_t lidar_rejected; // distances outside the innovation gate
+} fusion_stats_t;
+/* USER CODE END ET */
+
+/* Exported constants --------------------------------------------------------*/
+/* USER CODE BEGIN EC */
+// Range is an alpha-beta tracker, the steady state form of a two state
+// Kalman filter: the IMU acceleration along the LIDAR axis drives the
+// prediction at the IMU rate and each LIDAR distance corrects it.
+#define FUSION_LIDAR_SENSOR 0 // lidar_sample_t.sensor that looks along the range axis
+#define FUSION_RANGE_AXIS 0 // IMU axis the LIDAR points along, 0 = x
+#define FUSION_RANGE_SIGN (-1) // range shrinks when the board accelerates along +axis
+#define FUSION_ALPHA_Q16 19661 // 0.3, range correction gain
+#define FUSION_BETA_Q16 3277 // 0.05, rate correction gain
+#define FUSION_GATE_CM 100 // larger innovations are treated as spikes
+#define FUSION_GATE_MISSES 3 // after this many spikes in a row the range is re-seeded
+#define FUSION_ACCEL_BIAS_SHIFT 11 // time constant of the accel high-pass, in IMU samples
+
+// Tilt is a complementary filter: integrated gyro, pulled towards the
+// gravity direction from the accelerometer by 1 / 2^FUSION_TILT_SHIFT per sample.
+#define FUSION_TILT_SHIFT 9 // about 0.3 s at 1.66 kHz
+
+#define FUSION_DT_MAX_US 100000 // longer gaps are not integrated across
+#define FUSION_OUTPUT_DECIMATE 16 // one fusion_update_imu() output per this many IMU samples, about 100 Hz
+/* USER CODE END EC */
+
+/* Exported macro ------------------------------------------------------------*/
+/* USER CODE BEGIN EM */
+
+/* USER CODE END EM */
+
+/* Exported functions prototypes ---------------------------------------------*/
+/* USER CODE BEGIN EFP */
+void fusion_init(void);
+void fusion_update_lidar(uint16_t distance, uint32_t t);
+uint8_t fusion_update_imu(const imu_sample_t* psample, fusion_state_t* pstate); // returns 1 if *pstate is a new output
+void fusion_get_stats(fusion_stats_t* pstats);
+int32_t fusion_atan2(int32_t y, int32_t x); // millidegrees
+/* USER CODE END EFP */
+
+/* Private defines -----------------------------------------------------------*/
+/* USER CODE BEGIN Private defines */
+
+/* USER CODE END Private defines */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FUSION_H */
@@ -0,0 +1,207 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : i2c.h
+  * @brief          : Header for i2c.c file.
+  *                   Interrupt/DMA driven transaction engine for I2C1 and I2C2.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __I2C_H
+#define __I2C_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "stm32f0xx_hal.h"
+#include <stdint.h>
+/* USER CODE END Includes */
+
+/* Exported types ------------------------------------------------------------*/
+/* USER CODE BEGIN ET */
+typedef struct i2c_xfer i2c_xfer_t;
+typedef void (*i2c_callback_t)(i2c_xfer_t *xfer);
+typedef struct i2c_bus i2c_bus_t; // defined after the constants it is sized with
+
+// One queued transaction. The write phase (if any) runs first, then the
+// read phase (if any) follows after a repeated START. Phases longer than 255
+// bytes are split with NBYTES reloads. The descriptor must stay valid until
+// status leaves I2C_XFER_PENDING.
+struct i2c_xfer
+{
+	uint8_t devaddr; // 7 bit slave address
+	const uint8_t *wbuf; // bytes to write, may be 0 if wlen is 0
+	uint16_t wlen;
+	uint8_t *rbuf; // bytes to read, may be 0 if rlen is 0
+	uint16_t rlen;
+	i2c_callback_t callback; // called from the bus interrupt on completion, may be 0
+	void *context; // free for the owner of the descriptor
+	volatile int8_t status;
+};
+
+typedef struct
+{
+	uint32_t nacks;
+	uint32_t timeouts;
+	uint32_t arbitration_losses;
+	uint32_t bus_errors;
+	uint32_t recoveries; // times the bus was clocked free and the peripheral re-initialized
+} i2c_stats_t;
+/* USER CODE END ET */
+
+/* Exported constants --------------------------------------------------------*/
+/* USER CODE BEGIN EC */
+#define I2C_SPEED_STANDARD 100000U
+#define I2C_SPEED_FAST 400000U
+#define I2C_SPEED_FAST_PLUS 1000000U
+
+#define I2C1_KERNEL_CLK_HZ 48000000U // SYSCLK, selected with RCC_CFGR3_I2C1SW
+#define I2C1_SPEED_DEFAULT I2C_SPEED_FAST // the LIDAR-Lite tops out at 400 kHz
+#define I2C2_KERNEL_CLK_HZ 48000000U // PCLK, I2C2 has no clock switch
+#define I2C2_SPEED_DEFAULT I2C_SPEED_FAST
+
+#define I2C_QUEUE_SIZE 8 // transactions that can wait for each bus
+#define I2C_IRQ_PRIORITY 1
+#define I2C_USE_DMA 1 // move TXDR/RXDR bytes with DMA1 instead of per-byte interrupts
+#define I2C_XFER_OK 0
+#define I2C_XFER_ERROR -1 // bad arguments, queue full or overrun
+#define I2C_XFER_NACK -2 // slave did not acknowledge
+#define I2C_XFER_TIMEOUT -3 // transaction missed its deadline, bus was recovered
+#define I2C_XFER_ARLO -4 // arbitration lost
+#define I2C_XFER_BERR -5 // misplaced START/STOP on the bus, bus was recovered
+#define I2C_XFER_PENDING 1
+#define I2C_TIMEOUT_US 3000 // deadline per transaction on top of its transfer time
+#define I2C_TIMEOUT_US_PER_BYTE 100 // worst case byte time used for the deadline (100 kHz)
+#define I2C_NBYTES_MAX 255 // largest NBYTES before RELOAD is needed
+
+// One I2C peripheral: its pins, interrupt and DMA channels, and the state of
+// its transaction engine. Each bus has its own queue and interrupt, so
+// transactions on I2C1 and I2C2 run at the same time.
+struct i2c_bus
+{
+	I2C_TypeDef *regs;
+	GPIO_TypeDef *port; // SCL and SDA are on the same port
+	uint32_t port_en; // RCC_AHBENR bit of the port
+	uint8_t scl_pin;
+	uint8_t sda_pin;
+	uint8_t af;
+	IRQn_Type irqn;
+	uint32_t rcc_mask; // same bit in RCC_APB1ENR and RCC_APB1RSTR
+	uint32_t fmp_mask; // SYSCFG_CFGR1 Fast-mode Plus drive bits for the pins
+	DMA_Channel_TypeDef *dma_tx;
+	DMA_Channel_TypeDef *dma_rx;
+	uint32_t dma_cselr_mask;
+	uint32_t dma_cselr;
+	uint32_t timing_standard; // TIMINGR values for the bus kernel clock
+	uint32_t timing_fast;
+	uint32_t timing_fast_plus;
+
+	i2c_xfer_t *queue[I2C_QUEUE_SIZE];
+	volatile uint8_t queue_head; // index of the active/next transaction
+	volatile uint8_t queue_count;
+	i2c_xfer_t *volatile active;
+	uint8_t phase; // write or read phase of the active transaction
+	uint16_t index; // byte index within the current phase
+	uint16_t unprogrammed; // bytes of the current phase not yet loaded into NBYTES
+	int8_t result; // result of the active transaction so far
+	uint32_t started; // timebase_us() when the active transaction started
+	uint32_t timeout; // us the active transaction may take
+	uint32_t speed;
+	uint32_t timingr;
+	i2c_stats_t stats;
+};
+/* USER CODE END EC */
+
+/* Exported macro ------------------------------------------------------------*/
+/* USER CODE BEGIN EM */
+// Compile-time TIMINGR generator for the STM32F0 I2C (RM0091, I2C timings).
+// Times are in ps. PRESC is the smallest that fits both the SCL period and
+// SCLDEL; the period left after the synchronization delays is split between
+// SCL low and high in the ratio of the spec minimums and rounded up, so the
+// bus never runs faster than requested.
+#define I2C_PS_PER_S 1000000000000LL
+#define I2C_T_AF_MIN_PS 50000LL // analog filter delay, minimum
+#define I2C_T_LOW_PS(spd) ((spd) > I2C_SPEED_FAST ? 500000LL : (spd) > I2C_SPEED_STANDARD ? 1300000LL : 4700000LL)
+#define I2C_T_HIGH_PS(spd) ((spd) > I2C_SPEED_FAST ? 260000LL : (spd) > I2C_SPEED_STANDARD ? 600000LL : 4000000LL)
+#define I2C_T_SU_DAT_PS(spd) ((spd) > I2C_SPEED_FAST ? 50000LL : (spd) > I2C_SPEED_STANDARD ? 100000LL : 250000LL)
+#define I2C_T_R_PS(spd) ((spd) > I2C_SPEED_FAST ? 120000LL : (spd) > I2C_SPEED_STANDARD ? 300000LL : 1000000LL)
+#define I2C_T_F_PS(spd) ((spd) > I2C_SPEED_FAST ? 120000LL : 300000LL)
+
+#define I2C_CEIL_DIV(a, b) (((a) + (b) - 1) / (b))
+#define I2C_TCLK_PS(clk) (I2C_PS_PER_S / (clk))
+#define I2C_PRESC_FOR_SCL(clk, spd) ((clk) / ((spd) * 256LL)) // SCL period fits in 256 ticks
+#define I2C_PRESC_FOR_SCLDEL(clk, spd) \
+		(I2C_CEIL_DIV((I2C_T_R_PS(spd) + I2C_T_SU_DAT_PS(spd)) * (clk), 16 * I2C_PS_PER_S) - 1) // SCLDEL fits in 4 bits
+#define I2C_TIMING_PRESC(clk, spd) (I2C_PRESC_FOR_SCL(clk, spd) > I2C_PRESC_FOR_SCLDEL(clk, spd) ? \
+		I2C_PRESC_FOR_SCL(clk, spd) : I2C_PRESC_FOR_SCLDEL(clk, spd))
+#define I2C_TPRESC_PS(clk, spd) ((I2C_TIMING_PRESC(clk, spd) + 1) * I2C_TCLK_PS(clk))
+#define I2C_TSYNC_PS(clk) (2 * (I2C_T_AF_MIN_PS + 2 * I2C_TCLK_PS(clk)))
+#define I2C_TAVAIL_PS(clk, spd) (I2C_PS_PER_S / (spd) - I2C_TSYNC_PS(clk))
+#define I2C_TLOW_PS(clk, spd) (I2C_TAVAIL_PS(clk, spd) * I2C_T_LOW_PS(spd) / (I2C_T_LOW_PS(spd) + I2C_T_HIGH_PS(spd)))
+#define I2C_THIGH_PS(clk, spd) (I2C_TAVAIL_PS(clk, spd) - I2C_TLOW_PS(clk, spd))
+#define I2C_SDADEL_PS(clk, spd) (I2C_T_F_PS(spd) - I2C_T_AF_MIN_PS - 3 * I2C_TCLK_PS(clk))
+
+#define I2C_TIMING_SCLL(clk, spd) (I2C_CEIL_DIV(I2C_TLOW_PS(clk, spd), I2C_TPRESC_PS(clk, spd)) - 1)
+#define I2C_TIMING_SCLH(clk, spd) (I2C_CEIL_DIV(I2C_THIGH_PS(clk, spd), I2C_TPRESC_PS(clk, spd)) - 1)
+#define I2C_TIMING_SCLDEL(clk, spd) (I2C_CEIL_DIV(I2C_T_R_PS(spd) + I2C_T_SU_DAT_PS(spd), I2C_TPRESC_PS(clk, spd)) - 1)
+#define I2C_TIMING_SDADEL(clk, spd) (I2C_SDADEL_PS(clk, spd) > 0 ? \
+		I2C_CEIL_DIV(I2C_SDADEL_PS(clk, spd), I2C_TPRESC_PS(clk, spd)) : 0)
+
+#define I2C_TIMINGR(clk, spd) ((uint32_t)((I2C_TIMING_PRESC(clk, spd) << 28) | \
+		(I2C_TIMING_SCLDEL(clk, spd) << 20) | (I2C_TIMING_SDADEL(clk, spd) << 16) | \
+		(I2C_TIMING_SCLH(clk, spd) << 8) | I2C_TIMING_SCLL(clk, spd)))
+#define I2C_TIMING_VALID(clk, spd) (I2C_TAVAIL_PS(clk, spd) >= I2C_T_LOW_PS(spd) + I2C_T_HIGH_PS(spd) && \
+		I2C_TIMING_PRESC(clk, spd) <= 15 && I2C_TIMING_SCLL(clk, spd) <= 255 && \
+		I2C_TIMING_SCLH(clk, spd) <= 255 && I2C_TIMING_SCLDEL(clk, spd) <= 15 && \
+		I2C_TIMING_SDADEL(clk, spd) <= 15)
+/* USER CODE END EM */
+
+/* Exported variables --------------------------------------------------------*/
+/* USER CODE BEGIN EV */
+extern i2c_bus_t i2c1_bus; // PB6 SCL, PB7 SDA, DMA1 channels 2/3
+extern i2c_bus_t i2c2_bus; // PA11 SCL, PA12 SDA, DMA1 channels 4/5
+/* USER CODE END EV */
+
+/* Exported functions prototypes ---------------------------------------------*/
+/* USER CODE BEGIN EFP */
+void i2c_init(i2c_bus_t *bus); // pins, DMA, timing and interrupt of one bus
+int8_t i2c_set_speed(i2c_bus_t *bus, uint32_t hz); // I2C_SPEED_STANDARD, I2C_SPEED_FAST or I2C_SPEED_FAST_PLUS
+int8_t i2c_submit(i2c_bus_t *bus, i2c_xfer_t *xfer); // queues a transaction and returns immediately
+int8_t i2c_transfer(i2c_bus_t *bus, i2c_xfer_t *xfer); // queues a transaction and waits for it
+int8_t i2c_send_data(i2c_bus_t *bus, uint8_t devaddr, void *pdata, uint8_t size);
+int8_t i2c_recv_data(i2c_bus_t *bus, uint8_t devaddr, void *pdata, uint8_t size);
+int8_t i2c_write_read(i2c_bus_t *bus, uint8_t devaddr, const void *pwdata, uint8_t wsize, void *prdata, uint8_t rsize);
+void i2c_get_stats(i2c_bus_t *bus, i2c_stats_t *pstats);
+void i2c_poll_timeout(void); // deadline check for both buses, called from SysTick_Handler
+/* USER CODE END EFP */
+
+/* Private defines -----------------------------------------------------------*/
+/* USER CODE BEGIN Private defines */
+void i2c_start(i2c_bus_t *bus, uint32_t devaddr, uint16_t size, uint8_t dir); // initiates transfer with slave device with r/w intent
+int8_t i2c_stop(i2c_bus_t *bus); // sends the stop bit
+int8_t i2c_wait_idle(i2c_bus_t *bus); // waits until bus is idle
+void i2c_recover(i2c_bus_t *bus); // clocks a stuck slave free and re-initializes the peripheral
+/* USER CODE END Private defines */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __I2C_H */
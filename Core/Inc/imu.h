@@ -0,0 +1,130 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : imu.h
+  * @brief          : Header for imu.c file.
+  *                   LSM6DSL accelerometer/gyroscope on I2C2, FIFO driven.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __IMU_H
+#define __IMU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "stm32f0xx_hal.h"
+#include "i2c.h"
+#include "timebase.h"
+#include <stdint.h>
+/* USER CODE END Includes */
+
+/* Exported types ------------------------------------------------------------*/
+/* USER CODE BEGIN ET */
+typedef struct
+{
+	int16_t gyro[3]; // x, y, z raw, IMU_GYRO_MDPS_PER_LSB
+	int16_t accel[3]; // x, y, z raw, IMU_ACCEL_MG_PER_LSB_X1000 / 1000
+	uint32_t t_sample; // timebase_us() of the measurement, estimated from the drain time and the data rate
+	uint32_t t_complete; // timebase_us() when the burst holding the sample was read
+} imu_sample_t;
+
+typedef struct
+{
+	uint32_t samples; // samples pushed into the ring
+	uint32_t dropped; // samples lost because the ring was full
+	uint32_t drains; // FIFO burst reads
+	uint32_t overruns; // sensor FIFO filled up before it was drained
+	uint32_t errors; // I2C errors
+} imu_stats_t;
+/* USER CODE END ET */
+
+/* Exported constants --------------------------------------------------------*/
+/* USER CODE BEGIN EC */
+#define IMU_BUS (&i2c2_bus)
+#define IMU_ADDR 0x6A // SA0 low
+#define IMU_WHO_AM_I_REG 0x0F
+#define IMU_WHO_AM_I_VAL 0x6A
+
+#define IMU_FIFO_CTRL1_REG 0x06 // watermark [7:0], in 16 bit words
+#define IMU_FIFO_CTRL2_REG 0x07 // watermark [10:8]
+#define IMU_FIFO_CTRL3_REG 0x08 // gyro and accel decimation
+#define IMU_FIFO_CTRL3_NO_DECIMATION 0x09 // both sensors in the FIFO at full rate
+#define IMU_FIFO_CTRL5_REG 0x0A // FIFO ODR [6:3], mode [2:0]
+#define IMU_FIFO_MODE_BYPASS 0x00 // also empties the FIFO
+#define IMU_FIFO_MODE_CONTINUOUS 0x06 // oldest data is overwritten when full
+#define IMU_INT1_CTRL_REG 0x0D
+#define IMU_INT1_FTH 0x08 // FIFO watermark on INT1
+#define IMU_CTRL1_XL_REG 0x10 // accel ODR [7:4], full scale [3:2]
+#define IMU_CTRL2_G_REG 0x11 // gyro ODR [7:4], full scale [3:2]
+#define IMU_CTRL3_C_REG 0x12
+#define IMU_CTRL3_C_BDU 0x40 // output registers update as a whole
+#define IMU_CTRL3_C_IF_INC 0x04 // register address auto-increment
+#define IMU_CTRL3_C_SW_RESET 0x01
+#define IMU_FIFO_STATUS1_REG 0x3A // words in the FIFO [7:0], then [10:8], pattern
+#define IMU_FIFO_STATUS2_OVER_RUN 0x40
+#define IMU_FIFO_DATA_OUT_REG 0x3E // address rolls back here on a burst read
+
+#define IMU_ODR 0x08 // 1.66 kHz for accel, gyro and FIFO
+#define IMU_ODR_HZ 1660 // samples per second at IMU_ODR
+#define IMU_SAMPLE_PERIOD_US 602 // 1 / 1.66 kHz
+#define IMU_ACCEL_FS 0x08 // +-4 g
+#define IMU_ACCEL_MG_PER_LSB_X1000 122 // 0.122 mg/LSB at +-4 g
+#define IMU_GYRO_FS 0x0C // +-2000 dps
+#define IMU_GYRO_MDPS_PER_LSB 70
+
+#define IMU_WORDS_PER_SAMPLE 6 // gyro x,y,z then accel x,y,z
+#define IMU_FIFO_WATERMARK 32 // samples per watermark interrupt
+#define IMU_FIFO_BURST_MAX (2 * IMU_FIFO_WATERMARK) // samples read per burst
+#define IMU_RING_SIZE 256 // samples, must be a power of two
+
+// INT1, high while the FIFO is above the watermark (EXTI line 2)
+#define IMU_INT_PORT GPIOC
+#define IMU_INT_PIN GPIO_PIN_2
+#define IMU_INT_EXTICR_PORT 0x2 // SYSCFG EXTICR code for port C
+/* USER CODE END EC */
+
+/* Exported macro ------------------------------------------------------------*/
+/* USER CODE BEGIN EM */
+
+/* USER CODE END EM */
+
+/* Exported functions prototypes ---------------------------------------------*/
+/* USER CODE BEGIN EFP */
+int8_t imu_init(void); // resets and configures the sensor, 0 if it answered
+void imu_start(void); // FIFO in continuous mode, drained on the watermark interrupt
+void imu_stop(void);
+uint16_t imu_available(void);
+uint8_t imu_read(imu_sample_t* psample); // returns 1 if a sample was read
+void imu_get_stats(imu_stats_t* pstats);
+int8_t imu_write_reg(uint8_t reg, uint8_t val);
+int8_t imu_read_regs(uint8_t reg, uint8_t* pdata, uint8_t size);
+/* USER CODE END EFP */
+
+/* Private defines -----------------------------------------------------------*/
+/* USER CODE BEGIN Private defines */
+
+/* USER CODE END Private defines */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __IMU_H */
@@ -38,23 +38,126 @@ extern "C" {
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "stm32f0xx_hal.h"
+#include "i2c.h"
+#include "timebase.h"
 #include <stdint.h> // for uint8_t
 #include <string.h> // for strlen() and strcmp()
 /* USER CODE END Includes */
 
 /* Exported types ------------------------------------------------------------*/
 /* USER CODE BEGIN ET */
-
+typedef struct lidar lidar_t; // defined after the constants it is sized with
+
+typedef struct
+{
+	uint16_t distance; // cm
+	uint8_t strength; // received signal strength (register 0x0e)
+	uint8_t status; // status register 0x01
+	uint8_t sensor; // id of the lidar_t that produced the sample
+	int8_t velocity; // cm between this and the sensor's previous measurement (register 0x09)
+	int16_t rate; // cm/s, velocity over the sensor's measurement interval, 0 when that is unknown
+	uint32_t t_trigger; // timebase_us() when the measurement was started
+	uint32_t t_complete; // timebase_us() when the sample was read
+} lidar_sample_t;
+
+typedef struct
+{
+	uint32_t samples; // samples pushed into the ring
+	uint32_t dropped; // samples lost because the ring was full
+	uint32_t overruns; // timer ticks skipped because the previous sample was still in flight
+	uint32_t errors; // I2C errors and status poll timeouts
+} lidar_acq_stats_t;
 /* USER CODE END ET */
 
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
 #define LIDAR_ACQ_COMMAND_REG 0x00 // register to write to to get data
-#define LIDAR_ACQ_COMMAND_VAL 0x04
+#define LIDAR_ACQ_COMMAND_VAL 0x04 // acquire with receiver bias correction
+#define LIDAR_ACQ_COMMAND_NO_BIAS 0x03 // acquire without bias correction, faster
+#define LIDAR_BIAS_INTERVAL_DEFAULT 100 // free-running mode corrects bias once per this many samples
 #define LIDAR_STATUS_REG 0x01
+#define LIDAR_STATUS_BUSY 0x01
 #define LIDAR_DIST_ADDR 0x8F
+#define LIDAR_VELOCITY_REG 0x09
+#define LIDAR_RATE_MAX_GAP_US 1000000 // samples further apart do not give a range rate
 #define LIDAR_TIMEOUT_VAL 9999
+#define LIDAR_MEASURE_TIMEOUT_US 50000 // lidar_wait_for_data() gives up after this
+#define LIDAR_DEFAULT_ADDR 0x62 // 7 bit address after power up
+
+// one auto-increment read (msb of the register address) from status (0x01)
+// through the distance low byte (0x10) returns a whole sample
+#define LIDAR_BURST_REG 0x81
+#define LIDAR_BURST_LEN 16
+#define LIDAR_BURST_STATUS 0 // 0x01
+#define LIDAR_BURST_VELOCITY 8 // 0x09, signed
+#define LIDAR_BURST_STRENGTH 13 // 0x0e
+#define LIDAR_BURST_DIST_HIGH 14 // 0x0f
+#define LIDAR_BURST_DIST_LOW 15 // 0x10
+
+#define LIDAR_ACQ_CONFIG_REG 0x04
+#define LIDAR_ACQ_CONFIG_DEFAULT 0x08
+#define LIDAR_ACQ_CONFIG_USE_DELAY 0x20 // repetition delay comes from LIDAR_MEASURE_DELAY_REG
+#define LIDAR_ACQ_CONFIG_MODE_MASK 0x03
+#define LIDAR_ACQ_CONFIG_MODE_STATUS 0x01 // MODE pin follows the busy flag
+#define LIDAR_OUTER_LOOP_COUNT_REG 0x11
+#define LIDAR_OUTER_LOOP_SINGLE 0x00
+#define LIDAR_OUTER_LOOP_CONTINUOUS 0xFF
+#define LIDAR_MEASURE_DELAY_REG 0x45
+#define LIDAR_MEASURE_DELAY_HZ 2000 // MEASURE_DELAY = LIDAR_MEASURE_DELAY_HZ / rate (0x14 is 100 Hz)
+#define LIDAR_UNIT_ID_REG 0x96 // serial number high/low (0x16, 0x17), auto-increment
+#define LIDAR_I2C_ID_HIGH_REG 0x18 // serial number written back to unlock the address change
+#define LIDAR_I2C_ID_LOW_REG 0x19
+#define LIDAR_I2C_SEC_ADDR_REG 0x1a
+#define LIDAR_I2C_CONFIG_REG 0x1e
+#define LIDAR_I2C_CONFIG_SEC_ADDR 0x00 // answer on the secondary address as well
+#define LIDAR_I2C_CONFIG_SEC_ONLY 0x08 // stop answering on the default address
+#define LIDAR_BOOT_MS 22 // power enable to first I2C access
 #define DATA_BFR_SIZE 1
+
+#define LIDAR_ACQ_RING_SIZE 256 // samples, must be a power of two
+#define LIDAR_ACQ_TIMER_HZ 100000 // TIM7 tick, sets the rate resolution
+#define LIDAR_ACQ_DEFAULT_RATE_HZ 200
+#define LIDAR_ACQ_MIN_RATE_HZ 2 // TIM7 ARR is 16 bit
+#define LIDAR_ACQ_IRQ_PRIORITY 2
+#define LIDAR_ACQ_DRAIN_US 100000 // longest wait for samples in flight after a stop
+#define LIDAR_MAX_SENSORS 4 // sensors the acquisition schedules, each keeps one transaction queued
+
+// adaptive rate: any sensor seeing motion or a weak return puts TIM7 at the
+// top rate at once, a static scene backs it off by a quarter per settle period
+#define LIDAR_ADAPT_MOTION_CM 3 // change between samples that counts as motion
+#define LIDAR_ADAPT_WEAK_SIGNAL 32 // signal strength below this is treated as noisy
+#define LIDAR_ADAPT_SETTLE 8 // static samples per sensor before each back-off step
+
+// sensor MODE pin, low when a measurement is complete (EXTI line 0)
+#define LIDAR_READY_PORT GPIOC
+#define LIDAR_READY_PIN GPIO_PIN_0
+#define LIDAR_READY_EXTICR_PORT 0x2 // SYSCFG EXTICR code for port C
+#define LIDAR_READY_TIMEOUT_US 20000 // wait for the edge before giving up, a measurement with bias correction is well under this
+
+// One LIDAR-Lite on I2C1 or I2C2. Every sensor comes up at
+// LIDAR_DEFAULT_ADDR, so with more than one on a bus all but one need a
+// power enable pin to be brought up one at a time by
+// lidar_assign_addresses(). The acquisition fields belong to TIM7 and the
+// bus completion interrupt while it runs.
+struct lidar
+{
+	i2c_bus_t *bus;
+	uint8_t addr; // 7 bit address the sensor answers on
+	uint8_t id; // position in the acquisition schedule, tags its samples
+	uint8_t config; // shadow of LIDAR_ACQ_CONFIG_REG
+	GPIO_TypeDef *enable_port; // power enable pin, 0 if the sensor is always on
+	uint16_t enable_pin;
+
+	i2c_xfer_t xfer;
+	uint8_t wbuf[2];
+	uint8_t rbuf[LIDAR_BURST_LEN];
+	volatile uint8_t state;
+	int8_t wait_slot; // schedule_after() slot of the MODE pin timeout, valid in LIDAR_ACQ_WAIT
+	uint16_t polls;
+	uint32_t t_trigger; // timebase_us() of the measurement in flight
+	uint16_t last_distance; // previous sample, for the adaptive rate
+	uint32_t last_t_trigger; // previous sample, for the range rate
+};
 /* USER CODE END EC */
 
 /* Exported macro ------------------------------------------------------------*/
@@ -72,13 +175,41 @@ void lidar_wait_for_data(); // step 2
 void lidar_read_dist_reg(uint16_t* pdist); // step 3
 
 void lidar_get_distance(uint16_t* pdist);
-void nano_wait(unsigned int n);
+int8_t lidar_get_sample(lidar_sample_t* psample); // trigger + burst polls, 0 on success
+int8_t lidar_write_reg(uint8_t reg, uint8_t val);
+
+// sensor instances, the calls above work on a default sensor at LIDAR_DEFAULT_ADDR
+void lidar_dev_init(lidar_t *dev, i2c_bus_t *bus, GPIO_TypeDef *enable_port, uint16_t enable_pin);
+int8_t lidar_dev_write_reg(lidar_t *dev, uint8_t reg, uint8_t val);
+int8_t lidar_dev_get_sample(lidar_t *dev, lidar_sample_t* psample);
+int8_t lidar_set_address(lidar_t *dev, uint8_t addr);
+int8_t lidar_assign_addresses(lidar_t *devs, uint8_t count, uint8_t first_addr);
+
+// free-running acquisition: TIM7 paces triggers, samples land in a ring buffer
+void lidar_acq_start(uint16_t rate_hz);
+void lidar_acq_stop(void);
+uint16_t lidar_acq_available(void);
+uint8_t lidar_acq_read(lidar_sample_t* psample); // returns 1 if a sample was read
+void lidar_acq_get_stats(lidar_acq_stats_t* pstats);
+void lidar_acq_set_bias_interval(uint16_t interval); // 1 = correct every sample
+void lidar_acq_set_adaptive(uint16_t min_hz, uint16_t max_hz); // max_hz = 0 keeps the lidar_acq_start() rate
+uint16_t lidar_acq_get_rate(void);
+int8_t lidar_acq_add(lidar_t *dev); // schedule a sensor, the default sensor is used if none were added
+
+// autonomous repetition mode: the sensor measures on its own, we only read the sample burst
+int8_t lidar_start_continuous(uint16_t rate_hz);
+int8_t lidar_stop_continuous(void);
+
+// completion from the sensor's MODE pin instead of status polling over I2C
+int8_t lidar_use_ready_pin(uint8_t enable);
+int8_t lidar_dev_use_ready_pin(lidar_t *dev, uint8_t enable); // one sensor's MODE pin on LIDAR_READY_PIN
 
 void lidar_test_start_stop();
 void lidar_test_send_one(); // test sending one byte
 void lidar_test_send_many(); // test multi-byte sending data once
 void lidar_test_read_one(); // one read from one register including write setups
 void lidar_test_get_one_distance(); // gets one distance reading
+void lidar_test_bias_rate(uint32_t* pcorrected_sps, uint32_t* pscheduled_sps); // samples/s with and without per-sample bias correction
 
 
 
@@ -87,12 +218,6 @@ void lidar_test_get_one_distance(); // gets one distance reading
 
 /* Private defines -----------------------------------------------------------*/
 /* USER CODE BEGIN Private defines */
-void i2c1_init(); // setup the I2C channel 1 subsystem
-void i2c1_start(uint32_t devaddr, uint8_t size, uint8_t dir); // initiates transfer with slave device with r/w intent
-void i2c1_stop(void); // sends the stop bit
-void i2c1_wait_idle(void); // waits until bus is idle
-int8_t i2c1_send_data(uint8_t devaddr, void *pdata, uint8_t size);
-int8_t i2c1_recv_data(uint8_t devaddr, void *pdata, uint8_t size);
 //void lidar_wait_for_data();
 /* USER CODE END Private defines */
 
@@ -0,0 +1,75 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : timebase.h
+  * @brief          : Header for timebase.c file.
+  *                   Free-running microsecond counter on TIM2.
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __TIMEBASE_H
+#define __TIMEBASE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "stm32f0xx_hal.h"
+#include <stdint.h>
+/* USER CODE END Includes */
+
+/* Exported types ------------------------------------------------------------*/
+/* USER CODE BEGIN ET */
+typedef void (*timebase_callback_t)(void *context);
+/* USER CODE END ET */
+
+/* Exported constants --------------------------------------------------------*/
+/* USER CODE BEGIN EC */
+#define TIMEBASE_HZ 1000000 // TIM2 tick, wraps after about 71.6 minutes
+#define TIMEBASE_SLOTS 4 // schedule_after() callbacks pending at once, one per TIM2 compare channel
+#define TIMEBASE_IRQ_PRIORITY 2
+#define TIMEBASE_SLEEP_MIN_US 1500 // delay_us() sleeps between interrupts while more than this is left, SysTick wakes it every 1 ms
+/* USER CODE END EC */
+
+/* Exported macro ------------------------------------------------------------*/
+/* USER CODE BEGIN EM */
+// Current time in us. A single register read, safe from any interrupt.
+// Differences of two stamps are correct across the wrap as long as they are
+// taken as uint32_t.
+#define timebase_us() (TIM2->CNT)
+/* USER CODE END EM */
+
+/* Exported functions prototypes ---------------------------------------------*/
+/* USER CODE BEGIN EFP */
+void timebase_init(void);
+void delay_us(uint32_t us); // busy wait, also safe from interrupts
+int8_t schedule_after(uint32_t us, timebase_callback_t callback, void *context); // slot, or -1 if all are taken
+void schedule_cancel(int8_t slot);
+/* USER CODE END EFP */
+
+/* Private defines -----------------------------------------------------------*/
+/* USER CODE BEGIN Private defines */
+
+/* USER CODE END Private defines */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TIMEBASE_H */
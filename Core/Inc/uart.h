@@ -35,7 +35,7 @@ extern "C" {
 
 /* Exported types ------------------------------------------------------------*/
 /* USER CODE BEGIN ET */
-
+typedef void (*uart_command_handler_t)(const uint8_t* pframe, uint16_t size); // from the header on, a binary frame without its sync and CRC
 /* USER CODE END ET */
 
 /* Exported constants --------------------------------------------------------*/
@@ -44,14 +44,62 @@ extern "C" {
 #define UART_COM_NONE 0b00
 #define UART_COM_START_DATA_COLLECTION 0b01
 #define UART_COM_STOP_DATA_COLLECTION 0b11
+#define UART_COM_SET_BAUD 0b10 // binary frame, UART_UINT16_T baud low and high word
+#define UART_COM_MASK 0b11
+#define UART_COM_COUNT 4
 
 #define UART_DATA_SOURCE_SHIFT 2
 #define UART_DATA_SOURCE_LIDAR 0b01 << UART_DATA_SOURCE_SHIFT
 #define UART_DATA_SOURCE_IMU 0b10 << UART_DATA_SOURCE_SHIFT
+#define UART_DATA_SOURCE_FUSION 0b11 << UART_DATA_SOURCE_SHIFT
 
 #define UART_DATA_TYPE_SHIFT 4
 #define UART_UINT8_T 0b0001 << UART_DATA_TYPE_SHIFT
 #define UART_UINT16_T 0b0010 << UART_DATA_TYPE_SHIFT
+#define UART_DELTA_VARINT 0b0011 << UART_DATA_TYPE_SHIFT // uint16 values, see below
+#define UART_DATA_TYPE_MASK 0b1111 << UART_DATA_TYPE_SHIFT
+
+// Binary frame: sync, the two header bytes from uart3_create_header(), a
+// sequence number that counts every frame encoded (gaps are lost frames),
+// num_data values little-endian, then a CRC-16-CCITT (0x1021, init 0xFFFF)
+// of everything after the sync, low byte first.
+#define UART_FRAME_SYNC 0xA5
+#define UART_FRAME_OVERHEAD 6 // sync, header, sequence, CRC
+#define UART_FRAME_PAYLOAD_MAX 128 // bytes
+#define UART_FRAME_MAX (UART_FRAME_OVERHEAD + UART_FRAME_PAYLOAD_MAX)
+#define UART_CRC_INIT 0xFFFF
+
+// UART_DELTA_VARINT payload: a stride byte, then num_data uint16 values,
+// each as the difference to the value stride places earlier (to 0 for the
+// first stride values), so every frame decodes on its own. A stride of the
+// record length deltas each field against the same field of the previous
+// record. The difference is taken mod 2^16, zigzag mapped (0, -1, 1, -2 ->
+// 0, 1, 2, 3) and sent 7 bits per byte, low group first, high bit set on
+// all but the last byte: 1 byte for |delta| < 64, at most 3.
+#define UART_VARINT_MAX 3 // bytes per uint16 value
+
+// Baud switch: the host sends UART_COM_SET_BAUD, the MCU answers with a
+// UART_COM_SET_BAUD frame of status, baud low and high word at the old
+// rate, then both switch. The host repeats the request at the new rate as a
+// probe and gets UART_BAUD_CONFIRMED back; without a probe within
+// UART_BAUD_PROBE_MS the MCU returns to the old rate.
+#define UART_BAUD_DEFAULT 115200
+#define UART_BAUD_MAX 6000000 // 48 MHz with 8x oversampling
+#define UART_BAUD_TOLERANCE_PCT 2 // largest BRR rounding error accepted
+#define UART_BAUD_PROBE_MS 500
+#define UART_BAUD_ACK 0 // switching after this frame
+#define UART_BAUD_NACK 1 // rate not reachable, staying put
+#define UART_BAUD_CONFIRMED 2 // probe received at the new rate
+
+#define UART_TX_RING_SIZE 1024 // bytes, must be a power of two
+#define UART_TX_DROP 0 // a write that does not fit is dropped whole
+#define UART_TX_BLOCK 1 // a write waits for room (drops instead when called from an interrupt)
+#define UART_TX_POLICY_DEFAULT UART_TX_DROP
+#define UART_DMA_IRQ_PRIORITY 2 // also USART3's, so the DMA and IDLE handlers never preempt each other
+
+#define UART_RX_DMA_SIZE 64 // circular DMA buffer, bytes
+#define UART_RX_FRAME_MAX 32 // longest host frame, longer ones are dropped
+#define UART_RX_FRAMES 4 // frames waiting for uart3_dispatch(), must be a power of two
 /* USER CODE END EC */
 
 /* Exported macro ------------------------------------------------------------*/
@@ -63,9 +111,24 @@ extern "C" {
 
 /* USER CODE BEGIN EFP */
 void uart3_init(void);
+int8_t uart3_set_baud(uint32_t baud); // 0 if the rate is reachable within UART_BAUD_TOLERANCE_PCT
+uint32_t uart3_get_baud(void);
 void uart3_create_header(uint8_t* pheader, uint8_t command, uint8_t d_source, uint8_t d_type, uint8_t num_data);
+uint8_t uart_type_size(uint8_t d_type); // bytes per value, 0 for an unknown or variable length type
+uint16_t uart_crc16(const uint8_t* pdata, uint16_t size, uint16_t crc);
+int16_t uart3_frame_encode(uint8_t* pframe, uint8_t command, uint8_t d_source, uint8_t d_type, const void* pdata, uint8_t num_data); // frame length, -1 if the payload does not fit
+int8_t uart3_send_frame(uint8_t command, uint8_t d_source, uint8_t d_type, const void* pdata, uint8_t num_data); // 0 if queued whole
+int16_t uart3_frame_encode_delta(uint8_t* pframe, uint8_t command, uint8_t d_source, const uint16_t* pvalues, uint8_t num_data, uint8_t stride); // frame length, -1 if the payload does not fit
+int8_t uart3_send_frame_delta(uint8_t command, uint8_t d_source, const uint16_t* pvalues, uint8_t num_data, uint8_t stride); // 0 if queued whole
 void uart3_send_byte(uint8_t);
 void uart3_send_string(char *);
+uint16_t uart3_write(const void* pdata, uint16_t size); // queues for DMA and returns, bytes queued
+void uart3_set_overflow_policy(uint8_t policy); // UART_TX_DROP or UART_TX_BLOCK
+uint32_t uart3_get_tx_dropped(void);
+void uart3_flush(void); // waits until the last queued byte is on the wire
+void uart3_set_command_handler(uint8_t command, uart_command_handler_t handler); // UART_COM_*
+void uart3_dispatch(void); // runs the handlers of the frames received so far, from the main loop
+uint32_t uart3_get_rx_errors(void); // line errors plus frames dropped as too long or for lack of room
 
 void uart3_test(void);
 /* USER CODE END EFP */
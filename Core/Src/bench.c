@@ -0,0 +1,253 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : bench.c
+  * @brief          : LIDAR acquisition strategy benchmark
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "bench.h"
+
+#if BENCH_MODE
+#include "lidar.h"
+#include "uart.h"
+#include "timebase.h"
+#include <stdio.h>
+#include <stdlib.h>
+#endif /* BENCH_MODE */
+/* USER CODE END Includes */
+
+/* Private typedef -----------------------------------------------------------*/
+/* USER CODE BEGIN PTD */
+
+/* USER CODE END PTD */
+
+/* Private define ------------------------------------------------------------*/
+/* USER CODE BEGIN PD */
+#define BENCH_DRAIN_US 50000 // lets the samples in flight finish after a stop
+/* USER CODE END PD */
+
+/* Private macro -------------------------------------------------------------*/
+/* USER CODE BEGIN PM */
+
+/* USER CODE END PM */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* USER CODE BEGIN PV */
+#if BENCH_MODE
+static const char *bench_names[BENCH_STRATEGIES] = {"blocking", "triggered", "triggered+bias", "ready pin", "continuous"};
+static uint16_t bench_latency[BENCH_MAX_SAMPLES];
+static uint32_t bench_idle_baseline = 0; // idle loop passes in BENCH_DURATION_MS with nothing to do
+#endif /* BENCH_MODE */
+/* USER CODE END PV */
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* USER CODE BEGIN PFP */
+#if BENCH_MODE
+static void bench_calibrate_idle(void);
+static void bench_start(uint8_t strategy);
+static void bench_stop(uint8_t strategy);
+static uint32_t bench_i2c_errors(void);
+static int bench_compare(const void *a, const void *b);
+#endif /* BENCH_MODE */
+/* USER CODE END PFP */
+
+/* Private user code ---------------------------------------------------------*/
+/* USER CODE BEGIN 0 */
+#if BENCH_MODE
+// CPU use is measured against the same loop with nothing arriving: every
+// pass that finds no sample counts as idle, interrupts take the rest.
+static void bench_calibrate_idle(void)
+{
+	lidar_sample_t sample;
+	uint32_t idle = 0;
+	uint32_t start = timebase_us();
+
+	while (timebase_us() - start < BENCH_DURATION_MS * 1000U)
+	{
+		if (lidar_acq_read(&sample))
+		{
+			continue;
+		}
+		idle++;
+	}
+	bench_idle_baseline = idle ? idle : 1;
+}
+
+static void bench_start(uint8_t strategy)
+{
+	switch (strategy)
+	{
+	case BENCH_TRIGGERED:
+		lidar_acq_set_bias_interval(LIDAR_BIAS_INTERVAL_DEFAULT);
+		lidar_acq_start(BENCH_RATE_HZ);
+		break;
+	case BENCH_TRIGGERED_BIAS:
+		lidar_acq_set_bias_interval(1);
+		lidar_acq_start(BENCH_RATE_HZ);
+		break;
+	case BENCH_READY_PIN:
+		lidar_use_ready_pin(1);
+		lidar_acq_set_bias_interval(LIDAR_BIAS_INTERVAL_DEFAULT);
+		lidar_acq_start(BENCH_RATE_HZ);
+		break;
+	case BENCH_CONTINUOUS:
+		lidar_start_continuous(BENCH_RATE_HZ);
+		break;
+	default:
+		break;
+	}
+}
+
+static void bench_stop(uint8_t strategy)
+{
+	lidar_sample_t sample;
+
+	switch (strategy)
+	{
+	case BENCH_TRIGGERED:
+	case BENCH_TRIGGERED_BIAS:
+		lidar_acq_stop();
+		break;
+	case BENCH_READY_PIN:
+		lidar_acq_stop();
+		delay_us(BENCH_DRAIN_US);
+		lidar_use_ready_pin(0);
+		break;
+	case BENCH_CONTINUOUS:
+		lidar_stop_continuous();
+		break;
+	default:
+		return;
+	}
+	delay_us(BENCH_DRAIN_US);
+	while (lidar_acq_read(&sample)); // leave nothing for the next run
+	lidar_acq_set_bias_interval(LIDAR_BIAS_INTERVAL_DEFAULT);
+}
+
+static uint32_t bench_i2c_errors(void)
+{
+	i2c_stats_t stats;
+	i2c_get_stats(&i2c1_bus, &stats);
+	return stats.nacks + stats.timeouts + stats.arbitration_losses + stats.bus_errors;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+// Runs one strategy for BENCH_DURATION_MS and collects the sample rate,
+// trigger to data latency, errors and CPU use.
+void bench_run(uint8_t strategy, bench_result_t* presult)
+{
+	lidar_acq_stats_t acq_before, acq_after;
+	lidar_sample_t sample;
+	uint32_t count = 0;
+	uint32_t idle = 0;
+	uint32_t failed = 0; // blocking samples that timed out
+	uint32_t sum = 0;
+	uint32_t min = 0xFFFFFFFF;
+	uint32_t max = 0;
+
+	if (bench_idle_baseline == 0)
+	{
+		bench_calibrate_idle();
+	}
+
+	uint32_t i2c_before = bench_i2c_errors();
+	lidar_acq_get_stats(&acq_before);
+	bench_start(strategy);
+
+	uint32_t start = timebase_us();
+	while (timebase_us() - start < BENCH_DURATION_MS * 1000U)
+	{
+		if (strategy == BENCH_BLOCKING)
+		{
+			if (lidar_get_sample(&sample))
+			{
+				failed++;
+				continue;
+			}
+		}
+		else if (!lidar_acq_read(&sample))
+		{
+			idle++;
+			continue;
+		}
+
+		uint32_t latency = sample.t_complete - sample.t_trigger;
+		if (count < BENCH_MAX_SAMPLES)
+		{
+			bench_latency[count] = (latency > 0xFFFF) ? 0xFFFF : latency;
+		}
+		count++;
+		sum += latency;
+		min = (latency < min) ? latency : min;
+		max = (latency > max) ? latency : max;
+	}
+
+	bench_stop(strategy);
+	lidar_acq_get_stats(&acq_after);
+
+	uint32_t kept = (count < BENCH_MAX_SAMPLES) ? count : BENCH_MAX_SAMPLES;
+	qsort(bench_latency, kept, sizeof(bench_latency[0]), bench_compare);
+
+	presult->samples_per_s = count * 1000 / BENCH_DURATION_MS;
+	presult->latency_min = count ? min : 0;
+	presult->latency_mean = count ? sum / count : 0;
+	presult->latency_p99 = kept ? bench_latency[kept * 99 / 100] : 0;
+	presult->latency_max = max;
+	presult->i2c_errors = bench_i2c_errors() - i2c_before;
+	presult->acq_errors = acq_after.errors - acq_before.errors + failed;
+	presult->errors_per_1000 = count ? (presult->i2c_errors + presult->acq_errors) * 1000 / count : 0;
+	idle = (idle > bench_idle_baseline) ? bench_idle_baseline : idle;
+	presult->cpu_percent = 100 - idle * 100 / bench_idle_baseline;
+}
+
+void bench_report(uint8_t strategy, const bench_result_t* presult)
+{
+	char line[96];
+
+	sprintf(line, "%s: %lu samples/s, cpu %lu%%\n\r", bench_names[strategy],
+			presult->samples_per_s, presult->cpu_percent);
+	uart3_send_string(line);
+	sprintf(line, "  latency us min %lu mean %lu p99 %lu max %lu\n\r", presult->latency_min,
+			presult->latency_mean, presult->latency_p99, presult->latency_max);
+	uart3_send_string(line);
+	sprintf(line, "  errors i2c %lu acq %lu (%lu per 1000)\n\r", presult->i2c_errors,
+			presult->acq_errors, presult->errors_per_1000);
+	uart3_send_string(line);
+}
+
+// Needs lidar_init(), uart3_init() and timebase_init() first. The ready pin
+// run assumes the default sensor's MODE pin is wired to LIDAR_READY_PIN.
+void bench_run_all(void)
+{
+	bench_result_t result;
+
+	uart3_send_string("lidar bench\n\r");
+	for (uint8_t i = 0; i < BENCH_STRATEGIES; i++)
+	{
+		bench_run(i, &result);
+		bench_report(i, &result);
+	}
+}
+#endif /* BENCH_MODE */
+/* USER CODE END 0 */
@@ -0,0 +1,260 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : filter.c
+  * @brief          : median, EMA and Kalman stages in fixed point
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "filter.h"
+#include <string.h>
+/* USER CODE END Includes */
+
+/* Private typedef -----------------------------------------------------------*/
+/* USER CODE BEGIN PTD */
+typedef uint16_t (*filter_stage_t)(filter_chain_t *f, uint16_t in);
+/* USER CODE END PTD */
+
+/* Private define ------------------------------------------------------------*/
+/* USER CODE BEGIN PD */
+#define FILTER_IN_MAX 0x7FFF // inputs are shifted into Q16 in an int32_t
+#define FILTER_Q16_ONE 0x10000
+/* USER CODE END PD */
+
+/* Private macro -------------------------------------------------------------*/
+/* USER CODE BEGIN PM */
+
+/* USER CODE END PM */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* USER CODE BEGIN PV */
+static volatile uint16_t filter_sink; // keeps the benchmarked calls from being optimized out
+/* USER CODE END PV */
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* USER CODE BEGIN PFP */
+static uint16_t filter_chain_stage(filter_chain_t *f, uint16_t in);
+static uint32_t filter_cycles_since(uint32_t start);
+static uint32_t filter_bench_stage(filter_stage_t stage, uint8_t stages, uint32_t overhead, uint32_t *pmax);
+/* USER CODE END PFP */
+
+/* Private user code ---------------------------------------------------------*/
+/* USER CODE BEGIN 0 */
+void filter_init(filter_chain_t *f, uint8_t stages, uint8_t decimate)
+{
+	memset(f, 0, sizeof(*f));
+	f->stages = stages;
+	f->decimate = decimate ? decimate : 1;
+	filter_set_median(f, FILTER_MEDIAN_N_DEFAULT);
+	filter_set_ema(f, FILTER_EMA_SHIFT_DEFAULT);
+	filter_set_kalman(f, FILTER_KALMAN_Q_DEFAULT, FILTER_KALMAN_R_DEFAULT);
+}
+
+// Window length is rounded up to odd so the median is a sample, not an average.
+void filter_set_median(filter_chain_t *f, uint8_t n)
+{
+	n |= 1;
+	f->median_n = (n > FILTER_MEDIAN_MAX) ? FILTER_MEDIAN_MAX : n;
+	f->median_pos = 0;
+	f->median_fill = 0;
+}
+
+void filter_set_ema(filter_chain_t *f, uint8_t shift)
+{
+	f->ema_shift = (shift > 15) ? 15 : shift;
+	f->ema_primed = 0;
+}
+
+void filter_set_kalman(filter_chain_t *f, uint16_t q_q8, uint16_t r_q8)
+{
+	f->kalman_q_q8 = q_q8;
+	f->kalman_r_q8 = r_q8 ? r_q8 : 1; // R = 0 would divide by zero on a settled P
+	f->kalman_primed = 0;
+}
+
+// Keeps the window sorted alongside the arrival order, so each sample costs
+// one removal and one insertion instead of a sort.
+uint16_t filter_median(filter_chain_t *f, uint16_t in)
+{
+	uint16_t *sorted = f->median_sorted;
+	uint8_t n = f->median_fill;
+	uint8_t i;
+
+	if (n == f->median_n)
+	{
+		uint16_t old = f->median_window[f->median_pos];
+		for (i = 0; sorted[i] != old; i++);
+		for (; i < n - 1; i++)
+		{
+			sorted[i] = sorted[i + 1];
+		}
+		n--;
+	}
+	else
+	{
+		f->median_fill++;
+	}
+
+	f->median_window[f->median_pos] = in;
+	if (++f->median_pos >= f->median_n)
+	{
+		f->median_pos = 0;
+	}
+
+	for (i = n; i > 0 && sorted[i - 1] > in; i--)
+	{
+		sorted[i] = sorted[i - 1];
+	}
+	sorted[i] = in;
+	return sorted[f->median_fill >> 1];
+}
+
+uint16_t filter_ema(filter_chain_t *f, uint16_t in)
+{
+	int32_t x = (int32_t)((in > FILTER_IN_MAX) ? FILTER_IN_MAX : in) << 16;
+
+	if (!f->ema_primed)
+	{
+		f->ema_q16 = x;
+		f->ema_primed = 1;
+	}
+	else
+	{
+		f->ema_q16 += (x - f->ema_q16) >> f->ema_shift;
+	}
+	return (f->ema_q16 + FILTER_Q16_ONE / 2) >> 16;
+}
+
+// Constant position model: predict P += Q, then K = P / (P + R),
+// x += K (z - x), P = (1 - K) P. K is the only divide per sample, a 32 bit
+// one since P is clamped to FILTER_KALMAN_P_MAX.
+uint16_t filter_kalman(filter_chain_t *f, uint16_t in)
+{
+	int32_t z = (int32_t)((in > FILTER_IN_MAX) ? FILTER_IN_MAX : in) << 16;
+
+	if (!f->kalman_primed)
+	{
+		f->kalman_x_q16 = z;
+		f->kalman_p_q8 = f->kalman_r_q8;
+		f->kalman_primed = 1;
+		return in;
+	}
+
+	uint32_t p = f->kalman_p_q8 + f->kalman_q_q8;
+	if (p > FILTER_KALMAN_P_MAX)
+	{
+		p = FILTER_KALMAN_P_MAX;
+	}
+	uint32_t k = (p << 16) / (p + f->kalman_r_q8); // Q16, below 1
+	f->kalman_x_q16 += (int32_t)(((int64_t)(z - f->kalman_x_q16) * k) >> 16);
+	f->kalman_p_q8 = ((FILTER_Q16_ONE - k) * p) >> 16;
+	return (f->kalman_x_q16 + FILTER_Q16_ONE / 2) >> 16;
+}
+
+// Runs the enabled stages in order and keeps one output per f->decimate
+// inputs, so the stream gets both cleaner and shorter.
+uint8_t filter_apply(filter_chain_t *f, uint16_t in, uint16_t *pout)
+{
+	if (f->stages & FILTER_MEDIAN)
+	{
+		in = filter_median(f, in);
+	}
+	if (f->stages & FILTER_EMA)
+	{
+		in = filter_ema(f, in);
+	}
+	if (f->stages & FILTER_KALMAN)
+	{
+		in = filter_kalman(f, in);
+	}
+
+	if (++f->decimate_count < f->decimate)
+	{
+		return 0;
+	}
+	f->decimate_count = 0;
+	*pout = in;
+	return 1;
+}
+
+static uint16_t filter_chain_stage(filter_chain_t *f, uint16_t in)
+{
+	uint16_t out = 0;
+	filter_apply(f, in, &out);
+	return out;
+}
+
+// SysTick counts core clocks down from LOAD, so a short interval is the
+// difference of two VAL reads across at most one reload.
+static uint32_t filter_cycles_since(uint32_t start)
+{
+	uint32_t now = SysTick->VAL;
+	return (start >= now) ? start - now : start + SysTick->LOAD + 1 - now;
+}
+
+// Feeds FILTER_BENCH_SAMPLES of a noisy 10 m target with a spike every 16th
+// sample through one stage and returns the mean cycles per call.
+static uint32_t filter_bench_stage(filter_stage_t stage, uint8_t stages, uint32_t overhead, uint32_t *pmax)
+{
+	filter_chain_t f;
+	uint32_t seed = 12345;
+	uint32_t total = 0;
+	uint32_t max = 0;
+
+	filter_init(&f, stages, 1);
+	for (int i = 0; i < FILTER_BENCH_SAMPLES; i++)
+	{
+		seed = seed * 1664525 + 1013904223;
+		uint16_t in = 1000 + (seed >> 28) + ((i & 15) == 0 ? 500 : 0);
+
+		__disable_irq();
+		uint32_t start = SysTick->VAL;
+		filter_sink = stage(&f, in);
+		uint32_t cycles = filter_cycles_since(start);
+		__enable_irq();
+
+		cycles = (cycles > overhead) ? cycles - overhead : 0;
+		total += cycles;
+		if (cycles > max)
+		{
+			max = cycles;
+		}
+	}
+	if (pmax)
+	{
+		*pmax = max;
+	}
+	return total / FILTER_BENCH_SAMPLES;
+}
+
+void filter_test_cycles(filter_bench_t *presult)
+{
+	// cost of the measurement itself, taken off every sample
+	__disable_irq();
+	uint32_t start = SysTick->VAL;
+	uint32_t overhead = filter_cycles_since(start);
+	__enable_irq();
+
+	presult->median_cycles = filter_bench_stage(filter_median, FILTER_MEDIAN, overhead, 0);
+	presult->ema_cycles = filter_bench_stage(filter_ema, FILTER_EMA, overhead, 0);
+	presult->kalman_cycles = filter_bench_stage(filter_kalman, FILTER_KALMAN, overhead, 0);
+	presult->chain_cycles = filter_bench_stage(filter_chain_stage, FILTER_ALL, overhead,
+			&presult->chain_max_cycles);
+}
+/* USER CODE END 0 */
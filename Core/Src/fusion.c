@@ -0,0 +1,293 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : fusion.c
+  * @brief          : fixed point LIDAR + IMU fusion
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "fusion.h"
+/* USER CODE END Includes */
+
+/* Private typedef -----------------------------------------------------------*/
+/* USER CODE BEGIN PTD */
+
+/* USER CODE END PTD */
+
+/* Private define ------------------------------------------------------------*/
+/* USER CODE BEGIN PD */
+#define FUSION_PER_US_Q32 4295 // 1e-6 in Q32, turns x * dt_us into x * dt_s
+#define FUSION_ACCEL_CMS2_Q16 7841 // 0.122 mg/LSB in cm/s^2, Q16
+#define FUSION_GYRO_CDPS 7 // 70 mdps/LSB in centidegrees/s
+#define FUSION_MDEG_TO_CDEG_Q16 6554 // 65536 / 10
+#define FUSION_HALF_TURN ((int64_t)18000 << 16) // 180 degrees, Q16 centidegrees
+/* USER CODE END PD */
+
+/* Private macro -------------------------------------------------------------*/
+/* USER CODE BEGIN PM */
+
+/* USER CODE END PM */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* USER CODE BEGIN PV */
+// all Q16: cm, cm/s, raw accel LSB, centidegrees
+static int32_t fusion_range;
+static int32_t fusion_rate;
+static int32_t fusion_accel_bias;
+static int32_t fusion_pitch;
+static int32_t fusion_roll;
+
+static uint8_t fusion_range_primed;
+static uint8_t fusion_tilt_primed;
+static uint8_t fusion_misses; // LIDAR distances gated out in a row
+static uint8_t fusion_decimate_count;
+static uint32_t fusion_t_imu; // last IMU t_sample
+static uint32_t fusion_t_lidar; // last accepted LIDAR distance
+static fusion_stats_t fusion_stats;
+/* USER CODE END PV */
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* USER CODE BEGIN PFP */
+static uint32_t fusion_isqrt(uint32_t x);
+static int32_t fusion_atan_q15(int32_t z);
+static int32_t fusion_scale_dt(int32_t x, uint32_t dt_us);
+static void fusion_tilt(const imu_sample_t* psample, uint32_t dt_us);
+static int32_t fusion_wrap(int64_t angle);
+/* USER CODE END PFP */
+
+/* Private user code ---------------------------------------------------------*/
+/* USER CODE BEGIN 0 */
+void fusion_init(void)
+{
+	fusion_range = 0;
+	fusion_rate = 0;
+	fusion_accel_bias = 0;
+	fusion_pitch = 0;
+	fusion_roll = 0;
+	fusion_range_primed = 0;
+	fusion_tilt_primed = 0;
+	fusion_misses = 0;
+	fusion_decimate_count = 0;
+	fusion_stats.imu_updates = 0;
+	fusion_stats.lidar_updates = 0;
+	fusion_stats.lidar_rejected = 0;
+}
+
+// Corrects the predicted range with a LIDAR distance taken at time t. The
+// distance is applied against the latest prediction; the LIDAR latency is a
+// few ms, well inside the range filter's time constant.
+void fusion_update_lidar(uint16_t distance, uint32_t t)
+{
+	int32_t z = (int32_t)distance << 16;
+
+	if (!fusion_range_primed)
+	{
+		fusion_range = z;
+		fusion_rate = 0;
+		fusion_t_lidar = t;
+		fusion_range_primed = 1;
+		return;
+	}
+
+	int32_t e = z - fusion_range;
+	if (e > ((int32_t)FUSION_GATE_CM << 16) || e < -((int32_t)FUSION_GATE_CM << 16))
+	{
+		fusion_stats.lidar_rejected++;
+		if (++fusion_misses >= FUSION_GATE_MISSES)
+		{
+			// the target really moved, start over from this distance
+			fusion_range_primed = 0;
+			fusion_misses = 0;
+		}
+		return;
+	}
+	fusion_misses = 0;
+	fusion_stats.lidar_updates++;
+
+	fusion_range += (int32_t)(((int64_t)e * FUSION_ALPHA_Q16) >> 16);
+
+	// beta * e / dt, the only divide per LIDAR sample; 1e6 / 65536 = 15625 / 1024
+	uint32_t dt = t - fusion_t_lidar;
+	fusion_t_lidar = t;
+	if (dt > 0 && dt <= FUSION_DT_MAX_US)
+	{
+		fusion_rate += (int32_t)((((int64_t)e * FUSION_BETA_Q16 * 15625) / dt) >> 10);
+	}
+}
+
+// Predicts range and rate forward to the IMU sample, updates the tilt and
+// fills *pstate every FUSION_OUTPUT_DECIMATE samples.
+uint8_t fusion_update_imu(const imu_sample_t* psample, fusion_state_t* pstate)
+{
+	uint32_t dt = psample->t_sample - fusion_t_imu;
+	if (fusion_stats.imu_updates == 0 || dt > FUSION_DT_MAX_US)
+	{
+		dt = 0;
+	}
+	fusion_t_imu = psample->t_sample;
+	fusion_stats.imu_updates++;
+
+	// gravity and bias along the axis change slowly, a high-pass leaves the motion
+	int32_t a_raw = (int32_t)psample->accel[FUSION_RANGE_AXIS] << 16;
+	if (fusion_stats.imu_updates == 1)
+	{
+		fusion_accel_bias = a_raw;
+	}
+	fusion_accel_bias += (a_raw - fusion_accel_bias) >> FUSION_ACCEL_BIAS_SHIFT;
+
+	if (fusion_range_primed)
+	{
+		int32_t a = (int32_t)(((int64_t)(a_raw - fusion_accel_bias) * FUSION_ACCEL_CMS2_Q16) >> 16);
+		fusion_range += fusion_scale_dt(fusion_rate, dt);
+		fusion_rate += FUSION_RANGE_SIGN * fusion_scale_dt(a, dt);
+	}
+
+	fusion_tilt(psample, dt);
+
+	if (++fusion_decimate_count < FUSION_OUTPUT_DECIMATE)
+	{
+		return 0;
+	}
+	fusion_decimate_count = 0;
+
+	int32_t range = (fusion_range + 0x8000) >> 16;
+	int32_t rate = (fusion_rate + 0x8000) >> 16;
+	pstate->range = (range < 0) ? 0 : (range > 0xFFFF) ? 0xFFFF : range;
+	pstate->rate = (rate < -32768) ? -32768 : (rate > 32767) ? 32767 : rate;
+	pstate->pitch = (fusion_pitch + 0x8000) >> 16;
+	pstate->roll = (fusion_roll + 0x8000) >> 16;
+	pstate->t = psample->t_sample;
+	return 1;
+}
+
+void fusion_get_stats(fusion_stats_t* pstats)
+{
+	*pstats = fusion_stats;
+}
+
+// Integrates the gyro and pulls the result towards the accelerometer's
+// gravity direction, both kept within +-180 degrees.
+static void fusion_tilt(const imu_sample_t* psample, uint32_t dt_us)
+{
+	int32_t ax = psample->accel[0];
+	int32_t ay = psample->accel[1];
+	int32_t az = psample->accel[2];
+
+	int32_t roll_acc = fusion_atan2(ay, az) * FUSION_MDEG_TO_CDEG_Q16;
+	int32_t pitch_acc = fusion_atan2(-ax, fusion_isqrt((uint32_t)(ay * ay) + (uint32_t)(az * az))) * FUSION_MDEG_TO_CDEG_Q16;
+
+	if (!fusion_tilt_primed)
+	{
+		fusion_roll = roll_acc;
+		fusion_pitch = pitch_acc;
+		fusion_tilt_primed = 1;
+		return;
+	}
+
+	// gyro increments in Q32 centidegrees, >> 16 to match the Q16 angles
+	int64_t gx = (int64_t)psample->gyro[0] * FUSION_GYRO_CDPS * dt_us * FUSION_PER_US_Q32;
+	int64_t gy = (int64_t)psample->gyro[1] * FUSION_GYRO_CDPS * dt_us * FUSION_PER_US_Q32;
+	fusion_roll = fusion_wrap(fusion_roll + (gx >> 16));
+	fusion_pitch = fusion_wrap(fusion_pitch + (gy >> 16));
+	fusion_roll = fusion_wrap(fusion_roll + (fusion_wrap((int64_t)roll_acc - fusion_roll) >> FUSION_TILT_SHIFT));
+	fusion_pitch = fusion_wrap(fusion_pitch + (fusion_wrap((int64_t)pitch_acc - fusion_pitch) >> FUSION_TILT_SHIFT));
+}
+
+// Brings a Q16 centidegree angle or angle difference into [-180, 180) degrees.
+static int32_t fusion_wrap(int64_t angle)
+{
+	while (angle >= FUSION_HALF_TURN)
+	{
+		angle -= 2 * FUSION_HALF_TURN;
+	}
+	while (angle < -FUSION_HALF_TURN)
+	{
+		angle += 2 * FUSION_HALF_TURN;
+	}
+	return (int32_t)angle;
+}
+
+// x per second times dt in us, without a divide
+static int32_t fusion_scale_dt(int32_t x, uint32_t dt_us)
+{
+	return (int32_t)(((int64_t)x * dt_us * FUSION_PER_US_Q32) >> 32);
+}
+
+// atan(z) for z in [0, 1] as Q15, in millidegrees. Uses
+// atan(z) ~ 45 z + z (1 - z) (14.02 + 3.79 z) degrees, within 0.1 degrees.
+static int32_t fusion_atan_q15(int32_t z)
+{
+	int32_t t = (z * (32768 - z)) >> 15;
+	int32_t c = 14020 + ((3790 * z) >> 15);
+	return ((45000 * z) >> 15) + ((t * c) >> 15);
+}
+
+// Four quadrant arctangent in millidegrees, one divide. |x| and |y| must be
+// below 65536 so the ratio fits Q15 in 32 bits.
+int32_t fusion_atan2(int32_t y, int32_t x)
+{
+	uint32_t ax = (x < 0) ? -x : x;
+	uint32_t ay = (y < 0) ? -y : y;
+	int32_t a;
+
+	if (ax == 0 && ay == 0)
+	{
+		return 0;
+	}
+	if (ay <= ax)
+	{
+		a = fusion_atan_q15((ay << 15) / ax);
+	}
+	else
+	{
+		a = 90000 - fusion_atan_q15((ax << 15) / ay);
+	}
+	if (x < 0)
+	{
+		a = 180000 - a;
+	}
+	return (y < 0) ? -a : a;
+}
+
+// Bit by bit integer square root, floor(sqrt(x)).
+static uint32_t fusion_isqrt(uint32_t x)
+{
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+
+	while (bit > x)
+	{
+		bit >>= 2;
+	}
+	while (bit)
+	{
+		if (x >= root + bit)
+		{
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+		{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+/* USER CODE END 0 */
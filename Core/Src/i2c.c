@@ -0,0 +1,632 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : i2c.c
+  * @brief          : I2C1/I2C2 transaction queues driven by interrupts and DMA
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "i2c.h"
+#include "timebase.h"
+/* USER CODE END Includes */
+
+/* Private typedef -----------------------------------------------------------*/
+/* USER CODE BEGIN PTD */
+
+/* USER CODE END PTD */
+
+/* Private define ------------------------------------------------------------*/
+/* USER CODE BEGIN PD */
+#define I2C_PHASE_WRITE 0
+#define I2C_PHASE_READ 1
+
+// interrupts used by the transaction engine, only enabled while it owns the bus
+#if I2C_USE_DMA
+#define I2C_ENGINE_IE (I2C_CR1_TCIE | I2C_CR1_STOPIE | I2C_CR1_NACKIE | I2C_CR1_ERRIE)
+#else
+#define I2C_ENGINE_IE (I2C_CR1_TXIE | I2C_CR1_RXIE | I2C_CR1_TCIE | I2C_CR1_STOPIE | \
+		I2C_CR1_NACKIE | I2C_CR1_ERRIE)
+#endif
+/* USER CODE END PD */
+
+/* Private macro -------------------------------------------------------------*/
+/* USER CODE BEGIN PM */
+
+/* USER CODE END PM */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* USER CODE BEGIN PV */
+i2c_bus_t i2c1_bus =
+{
+    .regs = I2C1,
+    .port = GPIOB,
+    .port_en = RCC_AHBENR_GPIOBEN,
+    .scl_pin = 6,
+    .sda_pin = 7,
+    .af = 1,
+    .irqn = I2C1_IRQn,
+    .rcc_mask = RCC_APB1ENR_I2C1EN,
+    .fmp_mask = SYSCFG_CFGR1_I2C_FMP_PB6 | SYSCFG_CFGR1_I2C_FMP_PB7,
+    .dma_tx = DMA1_Channel2,
+    .dma_rx = DMA1_Channel3,
+    .dma_cselr_mask = DMA_CSELR_C2S | DMA_CSELR_C3S,
+    .dma_cselr = DMA1_CSELR_CH2_I2C1_TX | DMA1_CSELR_CH3_I2C1_RX,
+    .timing_standard = I2C_TIMINGR(I2C1_KERNEL_CLK_HZ, I2C_SPEED_STANDARD),
+    .timing_fast = I2C_TIMINGR(I2C1_KERNEL_CLK_HZ, I2C_SPEED_FAST),
+    .timing_fast_plus = I2C_TIMINGR(I2C1_KERNEL_CLK_HZ, I2C_SPEED_FAST_PLUS),
+    .speed = I2C1_SPEED_DEFAULT,
+    .timingr = I2C_TIMINGR(I2C1_KERNEL_CLK_HZ, I2C1_SPEED_DEFAULT),
+};
+
+// PB10/PB11 and PB13/PB14 are taken by the LCD and SPI2, so I2C2 uses PA11/PA12
+i2c_bus_t i2c2_bus =
+{
+    .regs = I2C2,
+    .port = GPIOA,
+    .port_en = RCC_AHBENR_GPIOAEN,
+    .scl_pin = 11,
+    .sda_pin = 12,
+    .af = 5,
+    .irqn = I2C2_IRQn,
+    .rcc_mask = RCC_APB1ENR_I2C2EN,
+    .fmp_mask = SYSCFG_CFGR1_I2C_FMP_I2C2,
+    .dma_tx = DMA1_Channel4,
+    .dma_rx = DMA1_Channel5,
+    .dma_cselr_mask = DMA_CSELR_C4S | DMA_CSELR_C5S,
+    .dma_cselr = DMA1_CSELR_CH4_I2C2_TX | DMA1_CSELR_CH5_I2C2_RX,
+    .timing_standard = I2C_TIMINGR(I2C2_KERNEL_CLK_HZ, I2C_SPEED_STANDARD),
+    .timing_fast = I2C_TIMINGR(I2C2_KERNEL_CLK_HZ, I2C_SPEED_FAST),
+    .timing_fast_plus = I2C_TIMINGR(I2C2_KERNEL_CLK_HZ, I2C_SPEED_FAST_PLUS),
+    .speed = I2C2_SPEED_DEFAULT,
+    .timingr = I2C_TIMINGR(I2C2_KERNEL_CLK_HZ, I2C2_SPEED_DEFAULT),
+};
+
+_Static_assert(I2C_TIMING_VALID(I2C1_KERNEL_CLK_HZ, I2C_SPEED_STANDARD), "no valid I2C1 timing for 100 kHz");
+_Static_assert(I2C_TIMING_VALID(I2C1_KERNEL_CLK_HZ, I2C_SPEED_FAST), "no valid I2C1 timing for 400 kHz");
+_Static_assert(I2C_TIMING_VALID(I2C1_KERNEL_CLK_HZ, I2C_SPEED_FAST_PLUS), "no valid I2C1 timing for 1 MHz");
+_Static_assert(I2C_TIMING_VALID(I2C2_KERNEL_CLK_HZ, I2C_SPEED_STANDARD), "no valid I2C2 timing for 100 kHz");
+_Static_assert(I2C_TIMING_VALID(I2C2_KERNEL_CLK_HZ, I2C_SPEED_FAST), "no valid I2C2 timing for 400 kHz");
+_Static_assert(I2C_TIMING_VALID(I2C2_KERNEL_CLK_HZ, I2C_SPEED_FAST_PLUS), "no valid I2C2 timing for 1 MHz");
+/* USER CODE END PV */
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* USER CODE BEGIN PFP */
+static void i2c_begin_phase(i2c_bus_t *bus);
+static void i2c_reload(i2c_bus_t *bus);
+static void i2c_kick(i2c_bus_t *bus);
+static void i2c_complete(i2c_bus_t *bus, int8_t status);
+static void i2c_fail(i2c_bus_t *bus, int8_t status);
+static void i2c_check_timeout(i2c_bus_t *bus);
+static void i2c_poll_bus(i2c_bus_t *bus);
+static void i2c_irq(i2c_bus_t *bus);
+/* USER CODE END PFP */
+
+/* Private user code ---------------------------------------------------------*/
+/* USER CODE BEGIN 0 */
+void i2c_init(i2c_bus_t *bus)
+{
+    I2C_TypeDef *i2c = bus->regs;
+    GPIO_TypeDef *port = bus->port;
+    uint32_t pins_moder = (3U << 2 * bus->scl_pin) | (3U << 2 * bus->sda_pin);
+
+    if ((TIM2->CR1 & TIM_CR1_CEN) == 0)
+    {
+        timebase_init(); // the deadlines run on timebase_us()
+    }
+
+    RCC->AHBENR |= bus->port_en;
+    port->MODER &= ~pins_moder;
+    port->MODER |= (2U << 2 * bus->scl_pin) | (2U << 2 * bus->sda_pin);
+    port->OTYPER |= (1U << bus->scl_pin) | (1U << bus->sda_pin); // open-drain, i2c_recover() relies on it too
+    port->AFR[bus->scl_pin >> 3] &= ~(0xFU << 4 * (bus->scl_pin & 7));
+    port->AFR[bus->scl_pin >> 3] |= bus->af << 4 * (bus->scl_pin & 7);
+    port->AFR[bus->sda_pin >> 3] &= ~(0xFU << 4 * (bus->sda_pin & 7));
+    port->AFR[bus->sda_pin >> 3] |= bus->af << 4 * (bus->sda_pin & 7);
+
+    RCC->APB1ENR |= bus->rcc_mask;
+    if (i2c == I2C1)
+    {
+        RCC->CFGR3 |= RCC_CFGR3_I2C1SW; // kernel clock from SYSCLK, see I2C1_KERNEL_CLK_HZ
+    }
+
+    i2c->CR1 &= ~(I2C_CR1_PE | I2C_CR1_ANFOFF | I2C_CR1_ERRIE | I2C_CR1_NOSTRETCH |
+            I2C_CR1_TXDMAEN | I2C_CR1_RXDMAEN);
+
+#if I2C_USE_DMA
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    DMA1->CSELR &= ~bus->dma_cselr_mask;
+    DMA1->CSELR |= bus->dma_cselr;
+    bus->dma_tx->CCR = 0;
+    bus->dma_tx->CPAR = (uint32_t)&i2c->TXDR;
+    bus->dma_rx->CCR = 0;
+    bus->dma_rx->CPAR = (uint32_t)&i2c->RXDR;
+#endif
+
+    i2c->TIMINGR = bus->timingr;
+
+    // Fast-mode Plus needs the 20 mA drivers on the pins
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    if (bus->speed > I2C_SPEED_FAST)
+    {
+        SYSCFG->CFGR1 |= bus->fmp_mask;
+    }
+    else
+    {
+        SYSCFG->CFGR1 &= ~bus->fmp_mask;
+    }
+
+    i2c->OAR1 &= ~I2C_OAR1_OA1EN;
+    i2c->OAR2 &= ~I2C_OAR2_OA2EN;
+
+    i2c->CR2 &= ~I2C_CR2_ADD10;
+    i2c->CR2 |= I2C_CR2_AUTOEND;
+
+    i2c->CR1 |= I2C_CR1_PE;
+
+    HAL_NVIC_SetPriority(bus->irqn, I2C_IRQ_PRIORITY, 0);
+    HAL_NVIC_EnableIRQ(bus->irqn);
+}
+
+// Switches the bus speed between transactions. The TIMINGR values are all
+// computed at compile time for the bus kernel clock.
+int8_t i2c_set_speed(i2c_bus_t *bus, uint32_t hz)
+{
+    uint32_t timingr;
+    switch (hz)
+    {
+    case I2C_SPEED_STANDARD:
+        timingr = bus->timing_standard;
+        break;
+    case I2C_SPEED_FAST:
+        timingr = bus->timing_fast;
+        break;
+    case I2C_SPEED_FAST_PLUS:
+        timingr = bus->timing_fast_plus;
+        break;
+    default:
+        return I2C_XFER_ERROR;
+    }
+
+    if (bus->queue_count != 0)
+    {
+        return I2C_XFER_ERROR; // the engine owns the bus
+    }
+    bus->speed = hz;
+    bus->timingr = timingr;
+    i2c_init(bus); // TIMINGR can only be written with PE cleared
+    return I2C_XFER_OK;
+}
+
+// Sizes above I2C_NBYTES_MAX start with RELOAD set, the remainder is loaded
+// on each TCR. AUTOEND is always left off so the caller chooses between STOP
+// and a repeated START once TC is set.
+void i2c_start(i2c_bus_t *bus, uint32_t devaddr, uint16_t size, uint8_t dir)
+{
+    uint32_t tempreg = bus->regs->CR2;
+    tempreg &= ~(I2C_CR2_SADD | I2C_CR2_NBYTES | I2C_CR2_RELOAD |
+            I2C_CR2_AUTOEND | I2C_CR2_RD_WRN | I2C_CR2_START | I2C_CR2_STOP);
+    if (dir == 1)
+    {
+        tempreg |= I2C_CR2_RD_WRN;
+    }
+    else
+    {
+        tempreg &= ~I2C_CR2_RD_WRN;
+    }
+    if (size > I2C_NBYTES_MAX)
+    {
+        size = I2C_NBYTES_MAX;
+        tempreg |= I2C_CR2_RELOAD;
+    }
+    tempreg |= ((devaddr << 1) & I2C_CR2_SADD) | ((size << 16) & I2C_CR2_NBYTES);
+    tempreg |= I2C_CR2_START;
+    bus->regs->CR2 = tempreg;
+}
+
+int8_t i2c_stop(i2c_bus_t *bus)
+{
+    I2C_TypeDef *i2c = bus->regs;
+    if (i2c->ISR & I2C_ISR_STOPF)
+    {
+        return I2C_XFER_OK;
+    }
+    i2c->CR2 |= I2C_CR2_STOP; // Send stop bit as master
+
+    uint32_t start = timebase_us();
+    while( (i2c->ISR & I2C_ISR_STOPF) == 0) // Wait while stop flag is not set
+    {
+        if (timebase_us() - start > I2C_TIMEOUT_US)
+        {
+            i2c_recover(bus);
+            return I2C_XFER_TIMEOUT;
+        }
+    }
+    i2c->ICR |= I2C_ICR_STOPCF; // Clear stop flag
+    return I2C_XFER_OK;
+}
+
+int8_t i2c_wait_idle(i2c_bus_t *bus)
+{
+    uint32_t start = timebase_us();
+    while ((bus->regs->ISR & I2C_ISR_BUSY) == I2C_ISR_BUSY) // Wait while busy
+    {
+        if (timebase_us() - start > I2C_TIMEOUT_US)
+        {
+            i2c_recover(bus);
+            return I2C_XFER_TIMEOUT;
+        }
+    }
+    return I2C_XFER_OK;
+}
+
+// A slave that was interrupted mid-byte can hold SDA low forever. Take the
+// pins away from the peripheral, clock SCL until SDA is released (at most 9
+// clocks), send a STOP by hand, then reset and re-initialize the peripheral.
+void i2c_recover(i2c_bus_t *bus)
+{
+    GPIO_TypeDef *port = bus->port;
+    uint32_t scl = 1U << bus->scl_pin;
+    uint32_t sda = 1U << bus->sda_pin;
+
+    bus->regs->CR1 &= ~I2C_CR1_PE;
+
+    port->OTYPER |= scl | sda;
+    port->BSRR = scl | sda;
+    port->MODER &= ~((3U << 2 * bus->scl_pin) | (3U << 2 * bus->sda_pin));
+    port->MODER |= (1U << 2 * bus->scl_pin) | (1U << 2 * bus->sda_pin);
+    delay_us(5);
+
+    for (int i = 0; i < 9 && (port->IDR & sda) == 0; i++)
+    {
+        port->BSRR = scl << 16;
+        delay_us(5);
+        port->BSRR = scl;
+        delay_us(5);
+    }
+
+    // STOP: SDA rises while SCL is high
+    port->BSRR = scl << 16;
+    delay_us(5);
+    port->BSRR = sda << 16;
+    delay_us(5);
+    port->BSRR = scl;
+    delay_us(5);
+    port->BSRR = sda;
+    delay_us(5);
+
+    uint32_t irq_enabled = NVIC_GetEnableIRQ(bus->irqn);
+    RCC->APB1RSTR |= bus->rcc_mask;
+    RCC->APB1RSTR &= ~bus->rcc_mask;
+    i2c_init(bus);
+    if (!irq_enabled)
+    {
+        NVIC_DisableIRQ(bus->irqn); // i2c_poll_timeout() keeps it masked until the failure is retired
+    }
+    bus->stats.recoveries++;
+}
+
+// Fails the active transaction from outside the normal STOPF path. Bus level
+// problems also get the bus recovered before the next transaction starts.
+static void i2c_fail(i2c_bus_t *bus, int8_t status)
+{
+    switch (status)
+    {
+    case I2C_XFER_TIMEOUT:
+        bus->stats.timeouts++;
+        i2c_recover(bus);
+        break;
+    case I2C_XFER_BERR:
+        bus->stats.bus_errors++;
+        i2c_recover(bus);
+        break;
+    case I2C_XFER_ARLO:
+        bus->stats.arbitration_losses++;
+        break;
+    default:
+        break;
+    }
+    i2c_complete(bus, status);
+}
+
+static void i2c_check_timeout(i2c_bus_t *bus)
+{
+    if (bus->active != 0 && timebase_us() - bus->started > bus->timeout)
+    {
+        i2c_fail(bus, I2C_XFER_TIMEOUT);
+    }
+}
+
+// Only the bus's own interrupt is masked: a timeout recovers the bus by
+// bit-banging for a hundred us or so, and the UART, DMA and EXTI handlers
+// keep running meanwhile. The failed transaction's callback runs from the
+// caller's context, below the I2C priority.
+static void i2c_poll_bus(i2c_bus_t *bus)
+{
+    if (!NVIC_GetEnableIRQ(bus->irqn))
+    {
+        return; // bus not initialized
+    }
+    NVIC_DisableIRQ(bus->irqn);
+    i2c_check_timeout(bus);
+    NVIC_EnableIRQ(bus->irqn);
+}
+
+void i2c_poll_timeout(void)
+{
+    i2c_poll_bus(&i2c1_bus);
+    i2c_poll_bus(&i2c2_bus);
+}
+
+void i2c_get_stats(i2c_bus_t *bus, i2c_stats_t *pstats)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *pstats = bus->stats;
+    __set_PRIMASK(primask);
+}
+
+// Starts the phase of the active transaction selected by bus->phase.
+// Must be called with the bus interrupt masked or from its handler.
+static void i2c_begin_phase(i2c_bus_t *bus)
+{
+    i2c_xfer_t *xfer = bus->active;
+    uint16_t len = (bus->phase == I2C_PHASE_WRITE) ? xfer->wlen : xfer->rlen;
+    bus->index = 0;
+    bus->unprogrammed = (len > I2C_NBYTES_MAX) ? len - I2C_NBYTES_MAX : 0;
+    if (bus->phase == I2C_PHASE_WRITE)
+    {
+#if I2C_USE_DMA
+        bus->dma_tx->CCR = 0;
+        bus->dma_tx->CMAR = (uint32_t)xfer->wbuf;
+        bus->dma_tx->CNDTR = xfer->wlen;
+        bus->dma_tx->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+        bus->regs->CR1 = (bus->regs->CR1 & ~I2C_CR1_RXDMAEN) | I2C_CR1_TXDMAEN;
+#endif
+        i2c_start(bus, xfer->devaddr, xfer->wlen, 0);
+    }
+    else
+    {
+#if I2C_USE_DMA
+        bus->dma_rx->CCR = 0;
+        bus->dma_rx->CMAR = (uint32_t)xfer->rbuf;
+        bus->dma_rx->CNDTR = xfer->rlen;
+        bus->dma_rx->CCR = DMA_CCR_MINC | DMA_CCR_EN;
+        bus->regs->CR1 = (bus->regs->CR1 & ~I2C_CR1_TXDMAEN) | I2C_CR1_RXDMAEN;
+#endif
+        i2c_start(bus, xfer->devaddr, xfer->rlen, 1);
+    }
+}
+
+// Loads the next chunk of a long phase into NBYTES after TCR.
+static void i2c_reload(i2c_bus_t *bus)
+{
+    uint16_t chunk = bus->unprogrammed;
+    uint32_t tempreg = bus->regs->CR2 & ~(I2C_CR2_NBYTES | I2C_CR2_RELOAD);
+    if (chunk > I2C_NBYTES_MAX)
+    {
+        chunk = I2C_NBYTES_MAX;
+        tempreg |= I2C_CR2_RELOAD;
+    }
+    bus->unprogrammed -= chunk;
+    bus->regs->CR2 = tempreg | ((chunk << 16) & I2C_CR2_NBYTES);
+}
+
+// Starts the transaction at the head of the queue if the bus is free.
+// Must be called with interrupts disabled or from the bus interrupt.
+static void i2c_kick(i2c_bus_t *bus)
+{
+    if (bus->active != 0 || bus->queue_count == 0)
+    {
+        return;
+    }
+    i2c_xfer_t *xfer = bus->queue[bus->queue_head];
+    bus->active = xfer;
+    bus->result = I2C_XFER_OK;
+    bus->started = timebase_us();
+    bus->timeout = I2C_TIMEOUT_US + (xfer->wlen + xfer->rlen) * I2C_TIMEOUT_US_PER_BYTE;
+    bus->phase = (xfer->wlen > 0) ? I2C_PHASE_WRITE : I2C_PHASE_READ;
+    bus->regs->ICR = I2C_ICR_STOPCF | I2C_ICR_NACKCF | I2C_ICR_BERRCF | I2C_ICR_ARLOCF | I2C_ICR_OVRCF;
+    bus->regs->CR1 |= I2C_ENGINE_IE;
+    i2c_begin_phase(bus);
+}
+
+// Retires the active transaction, runs its callback and starts the next one.
+static void i2c_complete(i2c_bus_t *bus, int8_t status)
+{
+    i2c_xfer_t *xfer = bus->active;
+    bus->active = 0;
+    bus->queue_head = (bus->queue_head + 1) % I2C_QUEUE_SIZE;
+    bus->queue_count--;
+#if I2C_USE_DMA
+    bus->regs->CR1 &= ~(I2C_CR1_TXDMAEN | I2C_CR1_RXDMAEN);
+    bus->dma_tx->CCR = 0;
+    bus->dma_rx->CCR = 0;
+#endif
+    if (bus->queue_count == 0)
+    {
+        bus->regs->CR1 &= ~I2C_ENGINE_IE; // leave the peripheral to the polling helpers
+    }
+
+    xfer->status = status;
+    if (xfer->callback)
+    {
+        xfer->callback(xfer); // may submit the next transaction
+    }
+    i2c_kick(bus);
+}
+
+int8_t i2c_submit(i2c_bus_t *bus, i2c_xfer_t *xfer)
+{
+    if (xfer == 0 || (xfer->wlen == 0 && xfer->rlen == 0) ||
+            (xfer->wlen > 0 && xfer->wbuf == 0) || (xfer->rlen > 0 && xfer->rbuf == 0))
+    {
+        return I2C_XFER_ERROR;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (bus->queue_count >= I2C_QUEUE_SIZE)
+    {
+        __set_PRIMASK(primask);
+        return I2C_XFER_ERROR;
+    }
+    xfer->status = I2C_XFER_PENDING;
+    bus->queue[(bus->queue_head + bus->queue_count) % I2C_QUEUE_SIZE] = xfer;
+    bus->queue_count++;
+    i2c_kick(bus);
+    __set_PRIMASK(primask);
+    return I2C_XFER_OK;
+}
+
+// Blocking wrapper around i2c_submit(). The wait checks the bus deadline
+// itself rather than relying on SysTick, which sits below every other
+// interrupt, so it always ends. From an interrupt with priority at or above
+// I2C_IRQ_PRIORITY, or with interrupts masked, the bus interrupt cannot run
+// and every call ends in I2C_XFER_TIMEOUT.
+int8_t i2c_transfer(i2c_bus_t *bus, i2c_xfer_t *xfer)
+{
+    if (i2c_submit(bus, xfer) != I2C_XFER_OK)
+    {
+        return I2C_XFER_ERROR;
+    }
+    while (xfer->status == I2C_XFER_PENDING)
+    {
+        i2c_poll_bus(bus);
+    }
+    return xfer->status;
+}
+
+int8_t i2c_send_data(i2c_bus_t *bus, uint8_t devaddr, void *pdata, uint8_t size)
+{
+    if (size <= 0 || pdata == 0)
+    {
+        return -1;
+    }
+    i2c_xfer_t xfer = {.devaddr = devaddr, .wbuf = pdata, .wlen = size};
+    return i2c_transfer(bus, &xfer);
+}
+
+int8_t i2c_recv_data(i2c_bus_t *bus, uint8_t devaddr, void *pdata, uint8_t size)
+{
+    if (size <= 0 || pdata == 0)
+    {
+        return -1;
+    }
+    i2c_xfer_t xfer = {.devaddr = devaddr, .rbuf = pdata, .rlen = size};
+    return i2c_transfer(bus, &xfer);
+}
+
+// Writes pwdata (usually a register address) and reads rsize bytes back after
+// a repeated START, so no other transaction can get in between.
+int8_t i2c_write_read(i2c_bus_t *bus, uint8_t devaddr, const void *pwdata, uint8_t wsize, void *prdata, uint8_t rsize)
+{
+    if (wsize <= 0 || pwdata == 0 || rsize <= 0 || prdata == 0)
+    {
+        return -1;
+    }
+    i2c_xfer_t xfer = {.devaddr = devaddr, .wbuf = pwdata, .wlen = wsize,
+            .rbuf = prdata, .rlen = rsize};
+    return i2c_transfer(bus, &xfer);
+}
+
+static void i2c_irq(i2c_bus_t *bus)
+{
+    I2C_TypeDef *i2c = bus->regs;
+    uint32_t isr = i2c->ISR;
+    i2c_xfer_t *xfer = bus->active;
+
+    if (xfer == 0)
+    {
+        i2c->CR1 &= ~I2C_ENGINE_IE;
+        return;
+    }
+
+    if (isr & (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR))
+    {
+        // arbitration loss releases the bus without a STOP, so finish here
+        i2c->ICR = I2C_ICR_BERRCF | I2C_ICR_ARLOCF | I2C_ICR_OVRCF;
+        if (isr & I2C_ISR_BERR)
+        {
+            i2c_fail(bus, I2C_XFER_BERR);
+        }
+        else if (isr & I2C_ISR_ARLO)
+        {
+            i2c_fail(bus, I2C_XFER_ARLO);
+        }
+        else
+        {
+            i2c_fail(bus, I2C_XFER_ERROR);
+        }
+        return;
+    }
+
+    if (isr & I2C_ISR_NACKF)
+    {
+        i2c->ICR = I2C_ICR_NACKCF; // hardware sends STOP after a NACK
+        bus->result = I2C_XFER_NACK;
+        bus->stats.nacks++;
+    }
+
+#if !I2C_USE_DMA
+    if ((isr & I2C_ISR_TXIS) && bus->index < xfer->wlen)
+    {
+        i2c->TXDR = xfer->wbuf[bus->index++] & I2C_TXDR_TXDATA;
+    }
+
+    if ((isr & I2C_ISR_RXNE) && bus->index < xfer->rlen)
+    {
+        xfer->rbuf[bus->index++] = i2c->RXDR & I2C_RXDR_RXDATA;
+    }
+#endif
+
+    if (isr & I2C_ISR_TCR)
+    {
+        i2c_reload(bus); // writing NBYTES clears TCR
+    }
+
+    if (isr & I2C_ISR_TC)
+    {
+        if (bus->phase == I2C_PHASE_WRITE && xfer->rlen > 0)
+        {
+            bus->phase = I2C_PHASE_READ;
+            i2c_begin_phase(bus); // repeated START, also clears TC
+        }
+        else
+        {
+            i2c->CR2 |= I2C_CR2_STOP; // also clears TC
+        }
+    }
+
+    if (isr & I2C_ISR_STOPF)
+    {
+        i2c->ICR = I2C_ICR_STOPCF;
+        i2c_complete(bus, bus->result);
+    }
+}
+
+void I2C1_IRQHandler(void)
+{
+    i2c_irq(&i2c1_bus);
+}
+
+void I2C2_IRQHandler(void)
+{
+    i2c_irq(&i2c2_bus);
+}
+/* USER CODE END 0 */
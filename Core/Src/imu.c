@@ -0,0 +1,331 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : imu.c
+  * @brief          : LSM6DSL FIFO setup and watermark driven burst reads
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "imu.h"
+/* USER CODE END Includes */
+
+/* Private typedef -----------------------------------------------------------*/
+/* USER CODE BEGIN PTD */
+
+/* USER CODE END PTD */
+
+/* Private define ------------------------------------------------------------*/
+/* USER CODE BEGIN PD */
+#define IMU_DRAIN_IDLE 0
+#define IMU_DRAIN_STATUS 1 // reading FIFO_STATUS1..4
+#define IMU_DRAIN_DATA 2 // reading the FIFO burst
+
+// a burst can start mid-sample after an overrun, the partial sample is read and dropped
+#define IMU_FIFO_BUF_LEN ((IMU_FIFO_BURST_MAX + 1) * IMU_WORDS_PER_SAMPLE * 2)
+/* USER CODE END PD */
+
+/* Private macro -------------------------------------------------------------*/
+/* USER CODE BEGIN PM */
+
+/* USER CODE END PM */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* USER CODE BEGIN PV */
+// FIFO drain state, owned by EXTI2_3_IRQHandler and the I2C2 completion callback
+static i2c_xfer_t imu_xfer;
+static uint8_t imu_reg;
+static uint8_t imu_status[4];
+static uint8_t imu_fifo[IMU_FIFO_BUF_LEN];
+static volatile uint8_t imu_state = IMU_DRAIN_IDLE;
+static volatile uint8_t imu_pending = 0; // watermark edge seen while a drain was running
+static uint8_t imu_running = 0;
+static uint16_t imu_skip; // words of a partial sample at the start of the burst
+static uint16_t imu_count; // whole samples in the burst
+static uint16_t imu_backlog; // samples in the FIFO when the drain started
+static uint32_t imu_drain_time; // timebase_us() when the drain started
+static imu_stats_t imu_stats;
+
+// single producer (I2C2 interrupt) / single consumer (main loop) sample ring;
+// head and tail run freely and are masked on access
+static imu_sample_t imu_ring[IMU_RING_SIZE];
+static volatile uint16_t imu_ring_head = 0;
+static volatile uint16_t imu_ring_tail = 0;
+/* USER CODE END PV */
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* USER CODE BEGIN PFP */
+static void imu_drain_start(void);
+static void imu_drain_callback(i2c_xfer_t *xfer);
+static void imu_push_burst(void);
+/* USER CODE END PFP */
+
+/* Private user code ---------------------------------------------------------*/
+/* USER CODE BEGIN 0 */
+int8_t imu_write_reg(uint8_t reg, uint8_t val)
+{
+	uint8_t data[] = {reg, val};
+	return i2c_send_data(IMU_BUS, IMU_ADDR, data, sizeof(data));
+}
+
+int8_t imu_read_regs(uint8_t reg, uint8_t* pdata, uint8_t size)
+{
+	return i2c_write_read(IMU_BUS, IMU_ADDR, &reg, 1, pdata, size);
+}
+
+// Checks WHO_AM_I, resets the sensor and sets up both sensors and the FIFO
+// at IMU_ODR with a watermark of IMU_FIFO_WATERMARK samples on INT1. The
+// FIFO stays in bypass until imu_start().
+int8_t imu_init(void)
+{
+	uint8_t val = 0;
+	uint16_t watermark = IMU_FIFO_WATERMARK * IMU_WORDS_PER_SAMPLE;
+
+	i2c_init(IMU_BUS);
+	if (imu_read_regs(IMU_WHO_AM_I_REG, &val, 1) || val != IMU_WHO_AM_I_VAL)
+	{
+		return -1;
+	}
+
+	if (imu_write_reg(IMU_CTRL3_C_REG, IMU_CTRL3_C_SW_RESET | IMU_CTRL3_C_IF_INC))
+	{
+		return -1;
+	}
+	for (int i = 0; i < 10; i++)
+	{
+		HAL_Delay(1);
+		if (imu_read_regs(IMU_CTRL3_C_REG, &val, 1) == 0 && (val & IMU_CTRL3_C_SW_RESET) == 0)
+		{
+			break;
+		}
+	}
+
+	if (imu_write_reg(IMU_CTRL3_C_REG, IMU_CTRL3_C_BDU | IMU_CTRL3_C_IF_INC) ||
+			imu_write_reg(IMU_FIFO_CTRL5_REG, IMU_FIFO_MODE_BYPASS) ||
+			imu_write_reg(IMU_FIFO_CTRL1_REG, watermark & 0xFF) ||
+			imu_write_reg(IMU_FIFO_CTRL2_REG, (watermark >> 8) & 0x07) ||
+			imu_write_reg(IMU_FIFO_CTRL3_REG, IMU_FIFO_CTRL3_NO_DECIMATION) ||
+			imu_write_reg(IMU_INT1_CTRL_REG, IMU_INT1_FTH) ||
+			imu_write_reg(IMU_CTRL1_XL_REG, (IMU_ODR << 4) | IMU_ACCEL_FS) ||
+			imu_write_reg(IMU_CTRL2_G_REG, (IMU_ODR << 4) | IMU_GYRO_FS))
+	{
+		return -1;
+	}
+
+	RCC->AHBENR |= RCC_AHBENR_GPIOCEN;
+	RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+	IMU_INT_PORT->MODER &= ~GPIO_MODER_MODER2; // input
+	IMU_INT_PORT->PUPDR &= ~GPIO_PUPDR_PUPDR2;
+	SYSCFG->EXTICR[0] = (SYSCFG->EXTICR[0] & ~SYSCFG_EXTICR1_EXTI2) |
+			(IMU_INT_EXTICR_PORT << SYSCFG_EXTICR1_EXTI2_Pos);
+	EXTI->RTSR |= EXTI_RTSR_TR2;
+	EXTI->FTSR &= ~EXTI_FTSR_TR2;
+	// same priority as the I2C buses so the edge and the drain callbacks never preempt each other
+	HAL_NVIC_SetPriority(EXTI2_3_IRQn, I2C_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(EXTI2_3_IRQn);
+	return 0;
+}
+
+// Lets the FIFO fill continuously. Every watermark edge reads the whole
+// backlog in one burst, so the bus sees one transaction per
+// IMU_FIFO_WATERMARK samples instead of one per register.
+void imu_start(void)
+{
+	imu_write_reg(IMU_FIFO_CTRL5_REG, (IMU_ODR << 3) | IMU_FIFO_MODE_CONTINUOUS);
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	imu_running = 1;
+	imu_pending = 0;
+	EXTI->PR = EXTI_PR_PR2;
+	EXTI->IMR |= EXTI_IMR_MR2;
+	if (imu_state == IMU_DRAIN_IDLE && HAL_GPIO_ReadPin(IMU_INT_PORT, IMU_INT_PIN) == GPIO_PIN_SET)
+	{
+		imu_drain_start(); // already above the watermark, no edge will come
+	}
+	__set_PRIMASK(primask);
+}
+
+// Stops draining and empties the FIFO. A drain in flight still completes.
+void imu_stop(void)
+{
+	imu_running = 0;
+	EXTI->IMR &= ~EXTI_IMR_MR2;
+	imu_write_reg(IMU_FIFO_CTRL5_REG, IMU_FIFO_MODE_BYPASS);
+}
+
+uint16_t imu_available(void)
+{
+	return (uint16_t)(imu_ring_head - imu_ring_tail);
+}
+
+uint8_t imu_read(imu_sample_t* psample)
+{
+	uint16_t tail = imu_ring_tail;
+	if (tail == imu_ring_head)
+	{
+		// INT1 is a level; if a drain failed while it was high no edge is
+		// coming, so restart from here
+		if (imu_running && imu_state == IMU_DRAIN_IDLE &&
+				HAL_GPIO_ReadPin(IMU_INT_PORT, IMU_INT_PIN) == GPIO_PIN_SET)
+		{
+			uint32_t primask = __get_PRIMASK();
+			__disable_irq();
+			if (imu_state == IMU_DRAIN_IDLE)
+			{
+				imu_drain_start();
+			}
+			__set_PRIMASK(primask);
+		}
+		return 0;
+	}
+	*psample = imu_ring[tail & (IMU_RING_SIZE - 1)];
+	__DMB(); // finish reading the slot before handing it back
+	imu_ring_tail = tail + 1;
+	return 1;
+}
+
+void imu_get_stats(imu_stats_t* pstats)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*pstats = imu_stats;
+	__set_PRIMASK(primask);
+}
+
+// Reads the FIFO fill level and pattern position. Runs in interrupt context.
+static void imu_drain_start(void)
+{
+	imu_pending = 0;
+	imu_drain_time = timebase_us();
+	imu_reg = IMU_FIFO_STATUS1_REG;
+	imu_xfer.devaddr = IMU_ADDR;
+	imu_xfer.wbuf = &imu_reg;
+	imu_xfer.wlen = 1;
+	imu_xfer.rbuf = imu_status;
+	imu_xfer.rlen = sizeof(imu_status);
+	imu_xfer.callback = imu_drain_callback;
+	imu_state = IMU_DRAIN_STATUS;
+	if (i2c_submit(IMU_BUS, &imu_xfer) != I2C_XFER_OK)
+	{
+		imu_stats.errors++;
+		imu_state = IMU_DRAIN_IDLE;
+	}
+}
+
+// Splits the burst into samples. The FIFO holds gyro x,y,z then accel x,y,z
+// per sample, little endian. The newest sample was taken about when the drain
+// started, older ones are spaced back by the sample period.
+static void imu_push_burst(void)
+{
+	const uint8_t *p = &imu_fifo[imu_skip * 2];
+	uint32_t t = imu_drain_time - (uint32_t)(imu_backlog - 1) * IMU_SAMPLE_PERIOD_US;
+	uint32_t t_complete = timebase_us();
+
+	for (uint16_t n = 0; n < imu_count; n++, t += IMU_SAMPLE_PERIOD_US)
+	{
+		if ((uint16_t)(imu_ring_head - imu_ring_tail) >= IMU_RING_SIZE)
+		{
+			imu_stats.dropped++;
+			p += IMU_WORDS_PER_SAMPLE * 2;
+			continue;
+		}
+		imu_sample_t *psample = &imu_ring[imu_ring_head & (IMU_RING_SIZE - 1)];
+		for (int axis = 0; axis < 3; axis++, p += 2)
+		{
+			psample->gyro[axis] = (int16_t)(p[0] | (p[1] << 8));
+		}
+		for (int axis = 0; axis < 3; axis++, p += 2)
+		{
+			psample->accel[axis] = (int16_t)(p[0] | (p[1] << 8));
+		}
+		psample->t_sample = t;
+		psample->t_complete = t_complete;
+		__DMB(); // sample must be visible before the new head
+		imu_ring_head++;
+		imu_stats.samples++;
+	}
+}
+
+static void imu_drain_callback(i2c_xfer_t *xfer)
+{
+	if (xfer->status != I2C_XFER_OK)
+	{
+		imu_stats.errors++;
+		imu_state = IMU_DRAIN_IDLE;
+		return;
+	}
+
+	if (imu_state == IMU_DRAIN_STATUS)
+	{
+		uint16_t words = ((imu_status[1] & 0x07) << 8) | imu_status[0];
+		uint16_t pattern = ((imu_status[3] & 0x03) << 8) | imu_status[2];
+		if (imu_status[1] & IMU_FIFO_STATUS2_OVER_RUN)
+		{
+			imu_stats.overruns++;
+		}
+
+		imu_skip = pattern ? IMU_WORDS_PER_SAMPLE - pattern : 0;
+		imu_backlog = (words > imu_skip) ? (words - imu_skip) / IMU_WORDS_PER_SAMPLE : 0;
+		imu_count = (imu_backlog > IMU_FIFO_BURST_MAX) ? IMU_FIFO_BURST_MAX : imu_backlog;
+		if (imu_count == 0)
+		{
+			imu_state = IMU_DRAIN_IDLE;
+			return;
+		}
+
+		imu_reg = IMU_FIFO_DATA_OUT_REG;
+		xfer->rbuf = imu_fifo;
+		xfer->rlen = (imu_skip + imu_count * IMU_WORDS_PER_SAMPLE) * 2;
+		imu_state = IMU_DRAIN_DATA;
+		if (i2c_submit(IMU_BUS, xfer) != I2C_XFER_OK)
+		{
+			imu_stats.errors++;
+			imu_state = IMU_DRAIN_IDLE;
+		}
+		return;
+	}
+
+	imu_push_burst();
+	imu_stats.drains++;
+	imu_state = IMU_DRAIN_IDLE;
+	// INT1 stays high while the FIFO is above the watermark, so there may be
+	// no new edge for data that arrived during the burst
+	if (imu_running && (imu_pending || HAL_GPIO_ReadPin(IMU_INT_PORT, IMU_INT_PIN) == GPIO_PIN_SET))
+	{
+		imu_drain_start();
+	}
+}
+
+void EXTI2_3_IRQHandler(void)
+{
+	EXTI->PR = EXTI_PR_PR2;
+	if (!imu_running)
+	{
+		return;
+	}
+	if (imu_state == IMU_DRAIN_IDLE)
+	{
+		imu_drain_start();
+	}
+	else
+	{
+		imu_pending = 1;
+	}
+}
+/* USER CODE END 0 */
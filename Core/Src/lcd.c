@@ -6,6 +6,7 @@
 #include "stm32f0xx.h"
 #include <stdint.h>
 #include "lcd.h"
+#include "timebase.h"
 
 lcd_dev_t lcddev;
 
@@ -66,21 +67,12 @@ static void tft_reg_select(int val)
     }
 }
 
-//============================================================================
-// Wait for n nanoseconds. (Maximum: 4.294 seconds)
-//============================================================================
-static inline void nano_wait(unsigned int n) {
-    asm(    "        mov r0,%0\n"
-            "repeat: sub r0,#83\n"
-            "        bgt repeat\n" : : "r"(n) : "r0", "cc");
-}
-
 void LCD_Reset(void)
 {
     lcddev.reset(1);      // Assert reset
-    nano_wait(100000000); // Wait
+    delay_us(100000);     // Wait
     lcddev.reset(0);      // De-assert reset
-    nano_wait(50000000);  // Wait
+    delay_us(50000);      // Wait
 }
 
 // If you want to try the slower version of SPI, #define SLOW_SPI
@@ -337,7 +329,7 @@ void LCD_Init(void (*reset)(int), void (*select)(int), void (*reg_select)(int))
     LCD_WR_DATA(0x00);
     LCD_WR_DATA(0xef);
     LCD_WR_REG(0x11);     // Exit Sleep
-    nano_wait(120000000); // Wait 120 ms
+    delay_us(120000);     // Wait 120 ms
     LCD_WR_REG(0x29);     // Display on
 
     LCD_direction(USE_HORIZONTAL);
@@ -421,11 +413,11 @@ void spi2_data(unsigned int data) {
 }
 
 void spi2_init_oled() {
-    nano_wait(1000000);
+    delay_us(1000);
     spi2_cmd(0x38);
     spi2_cmd(0x08);
     spi2_cmd(0x01);
-    nano_wait(2000000);
+    delay_us(2000);
     spi2_cmd(0x06);
     spi2_cmd(0x02);
     spi2_cmd(0x0c);
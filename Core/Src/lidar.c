@@ -37,6 +37,12 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define LIDAR_ACQ_IDLE 0
+#define LIDAR_ACQ_TRIGGER 1
+#define LIDAR_ACQ_POLL 2
+#define LIDAR_ACQ_READ 3
+#define LIDAR_ACQ_WAIT 4 // triggered, waiting for the MODE pin edge
+
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -47,212 +53,776 @@
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
-uint8_t lidar_addr = 0x62; // default 7 bit address
+// sensor the single-sensor calls work on
+static lidar_t lidar_default = {.bus = &i2c1_bus, .addr = LIDAR_DEFAULT_ADDR, .config = LIDAR_ACQ_CONFIG_DEFAULT};
+
+// free-running acquisition state, owned by TIM7 and the bus completion
+// callbacks; the per-sensor part of the chain lives in each lidar_t
+static lidar_t *lidar_acq_devs[LIDAR_MAX_SENSORS];
+static uint8_t lidar_acq_count = 0;
+static uint8_t lidar_acq_next = 0; // sensor triggered first on the next tick
+static uint8_t lidar_acq_continuous = 0; // sensors repeat on their own, only read the distance
+static uint8_t lidar_acq_measure_delay = 0; // MEASURE_DELAY the sensors repeat with in continuous mode
+static lidar_t *lidar_ready_dev = 0; // sensor whose MODE pin is wired to LIDAR_READY_PIN
+static volatile uint8_t lidar_ready_early = 0; // MODE pin edge seen before the trigger completed
+static uint16_t lidar_acq_bias_interval = LIDAR_BIAS_INTERVAL_DEFAULT;
+static uint16_t lidar_acq_bias_count = 0; // ticks since the last bias correction
+static lidar_acq_stats_t lidar_acq_stats;
+static uint16_t lidar_acq_rate_hz = LIDAR_ACQ_DEFAULT_RATE_HZ; // current TIM7 rate
+static uint16_t lidar_adapt_min_hz = 0;
+static uint16_t lidar_adapt_max_hz = 0; // 0 while the rate is fixed
+static uint16_t lidar_adapt_still = 0; // static samples since the last rate change
+
+_Static_assert(LIDAR_MAX_SENSORS < I2C_QUEUE_SIZE, "each scheduled sensor needs a queue slot, plus one for blocking calls");
+
+// single producer (the I2C interrupts, which share a priority and never nest)
+// / single consumer (main loop) sample ring; head and tail run freely and are
+// masked on access
+static lidar_sample_t lidar_ring[LIDAR_ACQ_RING_SIZE];
+static volatile uint16_t lidar_ring_head = 0;
+static volatile uint16_t lidar_ring_tail = 0;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 
 /* USER CODE BEGIN PFP */
-
+static void lidar_acq_submit(lidar_t *dev, uint8_t state, uint8_t wlen, uint8_t rlen);
+static void lidar_acq_callback(i2c_xfer_t *xfer);
+static void lidar_acq_push(lidar_t *dev);
+static void lidar_acq_fail(lidar_t *dev);
+static void lidar_ready_timeout(void *context);
+static void lidar_acq_set_rate(uint16_t rate_hz);
+static void lidar_acq_adapt(lidar_t *dev, const lidar_sample_t *psample);
+static void lidar_acq_use_default(void);
+static uint8_t lidar_acq_idle(void);
+static int8_t lidar_acq_drain(void);
+static void lidar_decode_burst(lidar_t *dev, const uint8_t *pburst, lidar_sample_t *psample);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
-void i2c1_init()
+void lidar_init()
 {
-	RCC->AHBENR |= RCC_AHBENR_GPIOBEN;
-	GPIOB->MODER &= ~(GPIO_MODER_MODER6 | GPIO_MODER_MODER7);
-	GPIOB->MODER |= GPIO_MODER_MODER6_1 | GPIO_MODER_MODER7_1;
-	GPIOB->AFR[0] |= (1 << 4*6) | (1 << 4 * 7);
+	i2c_init(lidar_default.bus);
+}
 
-    RCC->APB1ENR |= RCC_APB1ENR_I2C1EN;
+void lidar_init_dist_measure()
+{
+	uint8_t init_data[] = {LIDAR_ACQ_COMMAND_REG, LIDAR_ACQ_COMMAND_VAL};
+	i2c_send_data(lidar_default.bus, lidar_default.addr, init_data, sizeof(init_data));
+}
 
-    I2C1->CR1 &= ~(I2C_CR1_PE | I2C_CR1_ANFOFF | I2C_CR1_ERRIE | I2C_CR1_NOSTRETCH);
+void lidar_wait_for_data()
+{
 
-    I2C1->TIMINGR = 0;
-    I2C1->TIMINGR &= ~I2C_TIMINGR_PRESC;
-    I2C1->TIMINGR |= 3 << 20;
-    I2C1->TIMINGR |= 1 << 16;
-    I2C1->TIMINGR |= 3 << 8;
-    I2C1->TIMINGR |= 9 << 0;
+	uint8_t reg_addr[] = {LIDAR_STATUS_REG};
 
-    I2C1->OAR1 &= ~I2C_OAR1_OA1EN;
-    I2C1->OAR2 &= ~I2C_OAR2_OA2EN;
+	uint32_t start = timebase_us();
+	uint8_t busy[] = {1};
+	while (busy[0])
+	{
+		if (timebase_us() - start > LIDAR_MEASURE_TIMEOUT_US)
+		{
+			break;
+		}
 
-    I2C1->CR2 &= ~I2C_CR2_ADD10;
-    I2C1->CR2 |= I2C_CR2_AUTOEND;
+		i2c_write_read(lidar_default.bus, lidar_default.addr, reg_addr, sizeof(reg_addr), busy, sizeof(busy));
+		busy[0] &= 0x01;
+		delay_us(10);
+	}
+}
 
-    I2C1->CR1 |= I2C_CR1_PE;
+void lidar_read_dist_reg(uint16_t* pdist)
+{
+	uint8_t reg_addr[] = {LIDAR_DIST_ADDR};
+	uint8_t temp[2] = {0};
+	i2c_write_read(lidar_default.bus, lidar_default.addr, reg_addr, sizeof(reg_addr), temp, sizeof(temp));
+
+	*pdist = ((temp[0] << 8) | temp[1]);
 }
 
-void i2c1_start(uint32_t devaddr, uint8_t size, uint8_t dir)
+int8_t lidar_write_reg(uint8_t reg, uint8_t val)
 {
-	uint32_t tempreg = I2C1->CR2;
-	tempreg &= ~(I2C_CR2_SADD | I2C_CR2_NBYTES | I2C_CR2_RELOAD |
-	        I2C_CR2_AUTOEND | I2C_CR2_RD_WRN | I2C_CR2_START | I2C_CR2_STOP);
-	if (dir == 1)
-    {
-		tempreg |= I2C_CR2_RD_WRN;
+	return lidar_dev_write_reg(&lidar_default, reg, val);
+}
+
+int8_t lidar_dev_write_reg(lidar_t *dev, uint8_t reg, uint8_t val)
+{
+	uint8_t data[] = {reg, val};
+	return i2c_send_data(dev->bus, dev->addr, data, sizeof(data));
+}
+
+// The velocity register is part of the burst, so the range rate costs no
+// extra bus time. The sensor differences its own consecutive measurements,
+// so it is scaled by the time between those: the programmed measurement
+// period in continuous mode, where reads may skip or repeat a measurement,
+// and the trigger interval otherwise. A triggered sample after a lost one
+// gets 0, its velocity spans an unknown interval.
+static void lidar_decode_burst(lidar_t *dev, const uint8_t *pburst, lidar_sample_t *psample)
+{
+	psample->distance = (pburst[LIDAR_BURST_DIST_HIGH] << 8) | pburst[LIDAR_BURST_DIST_LOW];
+	psample->strength = pburst[LIDAR_BURST_STRENGTH];
+	psample->status = pburst[LIDAR_BURST_STATUS];
+	psample->sensor = dev->id;
+	psample->velocity = (int8_t)pburst[LIDAR_BURST_VELOCITY];
+	psample->t_trigger = dev->t_trigger;
+	psample->t_complete = timebase_us();
+
+	uint32_t dt = dev->t_trigger - dev->last_t_trigger;
+	int32_t rate = 0;
+	if (lidar_acq_continuous)
+	{
+		rate = (int32_t)psample->velocity * LIDAR_MEASURE_DELAY_HZ / lidar_acq_measure_delay;
+	}
+	else if (dev->last_t_trigger && dt && dt <= LIDAR_RATE_MAX_GAP_US)
+	{
+		rate = (int32_t)psample->velocity * 1000000 / (int32_t)dt;
 	}
-    else
-    {
-        tempreg &= ~I2C_CR2_RD_WRN;
-    }
-    tempreg |= ((devaddr << 1) & I2C_CR2_SADD) | ((size << 16) & I2C_CR2_NBYTES);
-    tempreg |= I2C_CR2_START;
-    I2C1->CR2 = tempreg;
+	psample->rate = (rate > INT16_MAX) ? INT16_MAX : (rate < INT16_MIN) ? INT16_MIN : rate;
+	dev->last_t_trigger = dev->t_trigger;
 }
 
-void i2c1_stop(void)
+int8_t lidar_get_sample(lidar_sample_t* psample)
 {
-    if (I2C1->ISR & I2C_ISR_STOPF)
-    {
-        return;
-    }
-    I2C1->CR2 |= I2C_CR2_STOP; // Send stop bit as master
+	return lidar_dev_get_sample(&lidar_default, psample);
+}
+
+// Triggers a measurement and polls with the sample burst read, so the poll
+// that sees the busy bit clear already carries the distance.
+int8_t lidar_dev_get_sample(lidar_t *dev, lidar_sample_t* psample)
+{
+	uint8_t reg_addr[] = {LIDAR_BURST_REG};
+	uint8_t burst[LIDAR_BURST_LEN];
 
-    while( (I2C1->ISR & I2C_ISR_STOPF) == 0); // Wait while stop flag is not set
-    I2C1->ICR |= I2C_ICR_STOPCF; // Clear stop flag
+	if (lidar_dev_write_reg(dev, LIDAR_ACQ_COMMAND_REG, LIDAR_ACQ_COMMAND_VAL))
+	{
+		return -1;
+	}
+	dev->t_trigger = timebase_us();
+	for (uint16_t counter = 0; counter <= LIDAR_TIMEOUT_VAL; counter++)
+	{
+		// with the MODE pin wired, wait on its level instead of loading the bus;
+		// the busy bit in the burst still guards against an early read
+		while (dev == lidar_ready_dev && HAL_GPIO_ReadPin(LIDAR_READY_PORT, LIDAR_READY_PIN) == GPIO_PIN_SET &&
+				timebase_us() - dev->t_trigger < LIDAR_READY_TIMEOUT_US);
+		if (i2c_write_read(dev->bus, dev->addr, reg_addr, sizeof(reg_addr), burst, sizeof(burst)) == 0 &&
+				(burst[LIDAR_BURST_STATUS] & LIDAR_STATUS_BUSY) == 0)
+		{
+			lidar_decode_burst(dev, burst, psample);
+			return 0;
+		}
+	}
+	return -1;
 }
 
-void i2c1_wait_idle(void)
+void lidar_get_distance(uint16_t* pdist)
 {
-    while ((I2C1->ISR & I2C_ISR_BUSY) == I2C_ISR_BUSY); // Wait while busy
+	lidar_sample_t sample = {0};
+	lidar_get_sample(&sample);
+	*pdist = sample.distance;
 }
 
-int8_t i2c1_send_data(uint8_t devaddr, void *pdata, uint8_t size)
+// Sets up a sensor handle at the power-up address. A wired enable pin is
+// driven low, the sensor stays off until lidar_assign_addresses().
+void lidar_dev_init(lidar_t *dev, i2c_bus_t *bus, GPIO_TypeDef *enable_port, uint16_t enable_pin)
 {
-    int i;
-    if (size <= 0 || pdata == 0)
-    {
-        return -1;
-    }
-    uint8_t *udata = (uint8_t*)pdata;
-    i2c1_wait_idle();
+	memset(dev, 0, sizeof(*dev));
+	dev->bus = bus;
+	dev->addr = LIDAR_DEFAULT_ADDR;
+	dev->config = LIDAR_ACQ_CONFIG_DEFAULT;
+	dev->enable_port = enable_port;
+	dev->enable_pin = enable_pin;
+
+	if (enable_port)
+	{
+		GPIO_InitTypeDef init = {0};
+		RCC->AHBENR |= RCC_AHBENR_GPIOAEN << (((uint32_t)enable_port - GPIOA_BASE) / (GPIOB_BASE - GPIOA_BASE));
+		HAL_GPIO_WritePin(enable_port, enable_pin, GPIO_PIN_RESET);
+		init.Pin = enable_pin;
+		init.Mode = GPIO_MODE_OUTPUT_PP;
+		init.Pull = GPIO_NOPULL;
+		init.Speed = GPIO_SPEED_FREQ_LOW;
+		HAL_GPIO_Init(enable_port, &init);
+	}
+}
 
-    i2c1_start(devaddr, size, 0);
+// Moves a sensor that is alone on its current address to addr. The serial
+// number is read and written back to unlock I2C_SEC_ADDR, then the default
+// address is switched off from the new one. The sensor forgets the address
+// when it loses power.
+int8_t lidar_set_address(lidar_t *dev, uint8_t addr)
+{
+	uint8_t reg_addr[] = {LIDAR_UNIT_ID_REG};
+	uint8_t unit_id[2];
+
+	if (i2c_write_read(dev->bus, dev->addr, reg_addr, sizeof(reg_addr), unit_id, sizeof(unit_id)) ||
+			lidar_dev_write_reg(dev, LIDAR_I2C_ID_HIGH_REG, unit_id[0]) ||
+			lidar_dev_write_reg(dev, LIDAR_I2C_ID_LOW_REG, unit_id[1]) ||
+			lidar_dev_write_reg(dev, LIDAR_I2C_SEC_ADDR_REG, addr) ||
+			lidar_dev_write_reg(dev, LIDAR_I2C_CONFIG_REG, LIDAR_I2C_CONFIG_SEC_ADDR))
+	{
+		return -1;
+	}
+	dev->addr = addr;
+	return lidar_dev_write_reg(dev, LIDAR_I2C_CONFIG_REG, LIDAR_I2C_CONFIG_SEC_ONLY);
+}
 
-    for (i = 0; i < size; i++)
-    {
-        int count = 0;
-        while ((I2C1->ISR & I2C_ISR_TXIS) == 0)
-        {
-            count += 1;
-            if (count > 1000000)
-            {
-                return -1;
-            }
+// Gives count sensors the addresses first_addr, first_addr + 2, ... (the v3
+// only takes even secondary addresses). Sensors with an enable pin are all
+// switched off first, so a sensor without one (at most one) can be moved
+// while it is alone on the bus. The others are then powered up and moved
+// one at a time.
+int8_t lidar_assign_addresses(lidar_t *devs, uint8_t count, uint8_t first_addr)
+{
+	int8_t result = 0;
 
-            if ((I2C1->ISR & I2C_ISR_NACKF))
-            {
-                I2C1->ICR |= I2C_ICR_NACKCF;
-                i2c1_stop();
-                return -1;
-            }
-        }
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if (devs[i].enable_port)
+		{
+			HAL_GPIO_WritePin(devs[i].enable_port, devs[i].enable_pin, GPIO_PIN_RESET);
+		}
+	}
 
-        I2C1->TXDR = udata[i] & I2C_TXDR_TXDATA;
-        //nano_wait(1000000);
-    }
+	for (uint8_t wired = 0; wired < 2; wired++)
+	{
+		for (uint8_t i = 0; i < count; i++)
+		{
+			lidar_t *dev = &devs[i];
+			if ((dev->enable_port != 0) != wired)
+			{
+				continue;
+			}
+			if (wired)
+			{
+				HAL_GPIO_WritePin(dev->enable_port, dev->enable_pin, GPIO_PIN_SET);
+				HAL_Delay(LIDAR_BOOT_MS);
+				dev->addr = LIDAR_DEFAULT_ADDR;
+				dev->config = LIDAR_ACQ_CONFIG_DEFAULT;
+			}
+			if (lidar_set_address(dev, first_addr + 2 * i))
+			{
+				result = -1;
+			}
+		}
+	}
+	return result;
+}
 
-    while ((I2C1->ISR & I2C_ISR_TC) == 0 && (I2C1->ISR & I2C_ISR_NACKF) == 0);
+// Queues the next step of a sensor's acquisition chain. Runs in interrupt context.
+static void lidar_acq_submit(lidar_t *dev, uint8_t state, uint8_t wlen, uint8_t rlen)
+{
+	dev->state = state;
+	dev->xfer.devaddr = dev->addr;
+	dev->xfer.wbuf = dev->wbuf;
+	dev->xfer.wlen = wlen;
+	dev->xfer.rbuf = dev->rbuf;
+	dev->xfer.rlen = rlen;
+	dev->xfer.callback = lidar_acq_callback;
+	dev->xfer.context = dev;
+	if (i2c_submit(dev->bus, &dev->xfer) != I2C_XFER_OK)
+	{
+		lidar_acq_fail(dev);
+	}
+}
 
-    if ((I2C1->ISR & I2C_ISR_NACKF) != 0)
-    {
-        return -1;
-    }
+// Ends a sample that will not be read. The sensor may still have measured,
+// so the next velocity is not against the previous sample this driver saw.
+static void lidar_acq_fail(lidar_t *dev)
+{
+	lidar_acq_stats.errors++;
+	dev->last_t_trigger = 0;
+	dev->state = LIDAR_ACQ_IDLE;
+}
 
-    i2c1_stop();
-    return 0;
+// Decodes the burst just read into the sample ring and ends the sample.
+static void lidar_acq_push(lidar_t *dev)
+{
+	if ((uint16_t)(lidar_ring_head - lidar_ring_tail) >= LIDAR_ACQ_RING_SIZE)
+	{
+		lidar_acq_stats.dropped++;
+	}
+	else
+	{
+		lidar_sample_t *psample = &lidar_ring[lidar_ring_head & (LIDAR_ACQ_RING_SIZE - 1)];
+		lidar_decode_burst(dev, dev->rbuf, psample);
+		lidar_acq_adapt(dev, psample);
+		__DMB(); // sample must be visible before the new head
+		lidar_ring_head++;
+		lidar_acq_stats.samples++;
+	}
+	dev->state = LIDAR_ACQ_IDLE;
 }
 
-int8_t i2c1_recv_data(uint8_t devaddr, void *pdata, uint8_t size)
+// Same trigger/poll sequence as lidar_get_sample(), but each step is
+// started from the completion interrupt of the previous one.
+static void lidar_acq_callback(i2c_xfer_t *xfer)
 {
-    int i;
-    if (size <= 0 || pdata == 0)
-    {
-        return -1;
-    }
-    uint8_t *udata = (uint8_t*) pdata;
-    i2c1_wait_idle();
+	lidar_t *dev = xfer->context;
 
-    i2c1_start(devaddr, size, 1);
+	if (xfer->status != I2C_XFER_OK)
+	{
+		lidar_acq_fail(dev);
+		return;
+	}
 
-    for (i = 0; i < size; i++)
-    {
-        while ((I2C1->ISR & I2C_ISR_RXNE) == 0);
-        udata[i] = I2C1->RXDR & I2C_RXDR_RXDATA;
-        //nano_wait(1000000);
-    }
+	switch (dev->state)
+	{
+	case LIDAR_ACQ_TRIGGER:
+		dev->t_trigger = timebase_us(); // the sensor starts on the STOP of the command write
+		dev->polls = 0;
+		dev->wbuf[0] = LIDAR_BURST_REG;
+		if (dev == lidar_ready_dev && !lidar_ready_early &&
+				(dev->wait_slot = schedule_after(LIDAR_READY_TIMEOUT_US, lidar_ready_timeout, dev)) >= 0)
+		{
+			dev->state = LIDAR_ACQ_WAIT; // EXTI0_1_IRQHandler submits the read
+		}
+		else
+		{
+			// no timeout slot left falls back to polling the busy bit
+			uint8_t ready = (dev == lidar_ready_dev && lidar_ready_early);
+			lidar_acq_submit(dev, ready ? LIDAR_ACQ_READ : LIDAR_ACQ_POLL, 1, LIDAR_BURST_LEN);
+		}
+		break;
 
-    while ((I2C1->ISR & I2C_ISR_TC) == 0);
-    i2c1_stop();
-    return 0;
+	case LIDAR_ACQ_POLL:
+		if ((dev->rbuf[LIDAR_BURST_STATUS] & LIDAR_STATUS_BUSY) == 0)
+		{
+			lidar_acq_push(dev);
+		}
+		else if (++dev->polls > LIDAR_TIMEOUT_VAL)
+		{
+			lidar_acq_fail(dev);
+		}
+		else
+		{
+			lidar_acq_submit(dev, LIDAR_ACQ_POLL, 1, LIDAR_BURST_LEN);
+		}
+		break;
+
+	case LIDAR_ACQ_READ:
+		lidar_acq_push(dev);
+		break;
+
+	default:
+		dev->state = LIDAR_ACQ_IDLE;
+		break;
+	}
 }
 
-void lidar_init()
+// Adds a sensor to the acquisition schedule, its samples are tagged with
+// the order it was added in. Only while acquisition is stopped.
+int8_t lidar_acq_add(lidar_t *dev)
 {
-	i2c1_init();
+	if (lidar_acq_count >= LIDAR_MAX_SENSORS || (TIM7->CR1 & TIM_CR1_CEN))
+	{
+		return -1;
+	}
+	dev->id = lidar_acq_count;
+	dev->state = LIDAR_ACQ_IDLE;
+	lidar_acq_devs[lidar_acq_count++] = dev;
+	return 0;
 }
 
-void lidar_init_dist_measure()
+static void lidar_acq_use_default(void)
 {
-	uint8_t init_data[] = {LIDAR_ACQ_COMMAND_REG, LIDAR_ACQ_COMMAND_VAL};
-	i2c1_send_data(lidar_addr, init_data, sizeof(init_data));
+	if (lidar_acq_count == 0)
+	{
+		lidar_acq_add(&lidar_default);
+	}
 }
 
-void lidar_wait_for_data()
+static uint8_t lidar_acq_idle(void)
 {
+	for (uint8_t i = 0; i < lidar_acq_count; i++)
+	{
+		if (lidar_acq_devs[i]->state != LIDAR_ACQ_IDLE)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	uint8_t reg_addr[] = {LIDAR_STATUS_REG};
-	i2c1_send_data(lidar_addr, reg_addr, sizeof(reg_addr));
+// Starts triggering measurements at rate_hz on every scheduled sensor. Do
+// not mix with the blocking lidar_get_distance() while running, both drive
+// the same sensor.
+void lidar_acq_start(uint16_t rate_hz)
+{
+	if (rate_hz < LIDAR_ACQ_MIN_RATE_HZ)
+	{
+		rate_hz = LIDAR_ACQ_MIN_RATE_HZ;
+	}
+	lidar_acq_use_default();
+
+	RCC->APB1ENR |= RCC_APB1ENR_TIM7EN;
+	TIM7->CR1 &= ~TIM_CR1_CEN;
+	TIM7->PSC = SystemCoreClock / LIDAR_ACQ_TIMER_HZ - 1;
+	TIM7->ARR = LIDAR_ACQ_TIMER_HZ / rate_hz - 1;
+	lidar_acq_rate_hz = rate_hz;
+	lidar_adapt_still = 0;
+	TIM7->CNT = 0;
+	TIM7->EGR = TIM_EGR_UG; // load PSC now
+	TIM7->SR &= ~TIM_SR_UIF;
+	TIM7->DIER |= TIM_DIER_UIE;
+	HAL_NVIC_SetPriority(TIM7_IRQn, LIDAR_ACQ_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(TIM7_IRQn);
+	TIM7->CR1 |= TIM_CR1_CEN;
+}
 
-	uint16_t counter = 0;
-	uint8_t busy[] = {1};
-	while (busy[0])
+// Stops new triggers. Samples already in flight still complete; a sensor
+// waiting for its MODE pin edge is abandoned along with its timeout, so a
+// late edge finds nothing to read.
+void lidar_acq_stop(void)
+{
+	TIM7->CR1 &= ~TIM_CR1_CEN;
+	TIM7->DIER &= ~TIM_DIER_UIE;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	for (uint8_t i = 0; i < lidar_acq_count; i++)
 	{
-		if (counter > LIDAR_TIMEOUT_VAL)
+		if (lidar_acq_devs[i]->state == LIDAR_ACQ_WAIT)
 		{
-			break;
+			schedule_cancel(lidar_acq_devs[i]->wait_slot);
+			lidar_acq_devs[i]->state = LIDAR_ACQ_IDLE;
+			lidar_acq_devs[i]->last_t_trigger = 0; // that measurement is never read
 		}
+	}
+	lidar_ready_early = 0;
+	__set_PRIMASK(primask);
+}
 
-		i2c1_recv_data(lidar_addr, busy, sizeof(busy));
-		busy[0] &= 0x01;
-		counter++;
-		nano_wait(10000);
+// Waits for the samples in flight after lidar_acq_stop(). Every bus
+// transaction has its own deadline, this one only guards against a chain
+// that never ends.
+static int8_t lidar_acq_drain(void)
+{
+	uint32_t start = timebase_us();
+	while (!lidar_acq_idle())
+	{
+		if (timebase_us() - start > LIDAR_ACQ_DRAIN_US)
+		{
+			return -1;
+		}
 	}
+	return 0;
 }
 
-void lidar_read_dist_reg(uint16_t* pdist)
+uint16_t lidar_acq_available(void)
 {
-	uint8_t reg_addr[] = {LIDAR_DIST_ADDR};
-	i2c1_send_data(lidar_addr, reg_addr, sizeof(reg_addr));
+	return (uint16_t)(lidar_ring_head - lidar_ring_tail);
+}
 
-	uint8_t temp[2] = {0};
-	i2c1_recv_data(lidar_addr, temp, sizeof(temp));
+uint8_t lidar_acq_read(lidar_sample_t* psample)
+{
+	uint16_t tail = lidar_ring_tail;
+	if (tail == lidar_ring_head)
+	{
+		return 0;
+	}
+	*psample = lidar_ring[tail & (LIDAR_ACQ_RING_SIZE - 1)];
+	__DMB(); // finish reading the slot before handing it back
+	lidar_ring_tail = tail + 1;
+	return 1;
+}
 
-	*pdist = ((temp[0] << 8) | temp[1]);
+void lidar_acq_get_stats(lidar_acq_stats_t* pstats)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*pstats = lidar_acq_stats;
+	__set_PRIMASK(primask);
 }
 
-void lidar_get_distance(uint16_t* pdist)
+// Queues a trigger (or in continuous mode a read) for every idle sensor at
+// once. The sensors then measure in parallel while the bus queues
+// interleave their polls and reads, so the bus is only busy for the
+// transfers themselves. The first slot rotates so no sensor always waits
+// behind the others.
+void TIM7_IRQHandler(void)
 {
+	TIM7->SR &= ~TIM_SR_UIF;
+	uint8_t correct_bias = 0;
+	if (++lidar_acq_bias_count >= lidar_acq_bias_interval)
+	{
+		lidar_acq_bias_count = 0;
+		correct_bias = 1;
+	}
 
-	// step 1: initiate the transaction and set the register from which we want to read
-	lidar_init_dist_measure();
+	uint8_t i = lidar_acq_next;
+	for (uint8_t n = 0; n < lidar_acq_count; n++)
+	{
+		lidar_t *dev = lidar_acq_devs[i];
+		if (++i >= lidar_acq_count)
+		{
+			i = 0;
+		}
 
-	// step 2: wait till status reg lsb goes low
-	lidar_wait_for_data();
+		if (dev->state != LIDAR_ACQ_IDLE)
+		{
+			lidar_acq_stats.overruns++;
+			continue;
+		}
+
+		if (lidar_acq_continuous && !correct_bias)
+		{
+			// the sensor triggers itself, so the read start is the closest stamp
+			dev->t_trigger = timebase_us();
+			dev->wbuf[0] = LIDAR_BURST_REG;
+			lidar_acq_submit(dev, LIDAR_ACQ_READ, 1, LIDAR_BURST_LEN);
+			continue;
+		}
 
-	// step 3: read data register
-	lidar_read_dist_reg(pdist);
+		// in continuous mode a new command restarts the sensor's repetition
+		// loop, which is how the periodic bias correction is injected there
+		if (dev == lidar_ready_dev)
+		{
+			lidar_ready_early = 0;
+		}
+		dev->wbuf[0] = LIDAR_ACQ_COMMAND_REG;
+		dev->wbuf[1] = correct_bias ? LIDAR_ACQ_COMMAND_VAL : LIDAR_ACQ_COMMAND_NO_BIAS;
+		lidar_acq_submit(dev, LIDAR_ACQ_TRIGGER, 2, 0);
+	}
+
+	if (++lidar_acq_next >= lidar_acq_count)
+	{
+		lidar_acq_next = 0;
+	}
+}
+
+// Bias correction makes an acquisition noticeably slower, so the free-running
+// modes only ask for it once every interval samples.
+void lidar_acq_set_bias_interval(uint16_t interval)
+{
+	lidar_acq_bias_interval = interval ? interval : 1;
+	lidar_acq_bias_count = 0;
+}
+
+// Lets the sample stream pick the TIM7 rate between min_hz and max_hz:
+// motion or a weak return on any sensor jumps straight to max_hz so a
+// moving target is followed without delay, a static scene backs off towards
+// min_hz to save bus, UART and sensor power. In continuous mode only the
+// reads adapt, the sensors keep their own measurement delay.
+void lidar_acq_set_adaptive(uint16_t min_hz, uint16_t max_hz)
+{
+	if (min_hz < LIDAR_ACQ_MIN_RATE_HZ)
+	{
+		min_hz = LIDAR_ACQ_MIN_RATE_HZ;
+	}
+	if (max_hz && max_hz < min_hz)
+	{
+		max_hz = min_hz;
+	}
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	lidar_adapt_min_hz = min_hz;
+	lidar_adapt_max_hz = max_hz;
+	lidar_adapt_still = 0;
+	if (max_hz && (TIM7->CR1 & TIM_CR1_CEN))
+	{
+		lidar_acq_set_rate(max_hz);
+	}
+	__set_PRIMASK(primask);
+}
+
+uint16_t lidar_acq_get_rate(void)
+{
+	return lidar_acq_rate_hz;
+}
+
+// Called from the I2C interrupt with each new sample.
+static void lidar_acq_adapt(lidar_t *dev, const lidar_sample_t *psample)
+{
+	uint16_t last = dev->last_distance;
+	uint16_t delta = (psample->distance > last) ? psample->distance - last : last - psample->distance;
+	dev->last_distance = psample->distance;
+
+	if (lidar_adapt_max_hz == 0)
+	{
+		return;
+	}
+	if (delta >= LIDAR_ADAPT_MOTION_CM || psample->strength < LIDAR_ADAPT_WEAK_SIGNAL)
+	{
+		lidar_adapt_still = 0;
+		if (lidar_acq_rate_hz != lidar_adapt_max_hz)
+		{
+			lidar_acq_set_rate(lidar_adapt_max_hz);
+		}
+	}
+	else if (++lidar_adapt_still >= LIDAR_ADAPT_SETTLE * lidar_acq_count && lidar_acq_rate_hz > lidar_adapt_min_hz)
+	{
+		uint16_t rate = lidar_acq_rate_hz - (lidar_acq_rate_hz >> 2);
+		lidar_adapt_still = 0;
+		lidar_acq_set_rate(rate < lidar_adapt_min_hz ? lidar_adapt_min_hz : rate);
+	}
+}
+
+// Retimes TIM7 without stopping it. A shorter period that the counter has
+// already passed fires a tick right away instead of running on to 0xFFFF.
+static void lidar_acq_set_rate(uint16_t rate_hz)
+{
+	lidar_acq_rate_hz = rate_hz;
+	TIM7->ARR = LIDAR_ACQ_TIMER_HZ / rate_hz - 1;
+	if (TIM7->CNT >= TIM7->ARR)
+	{
+		TIM7->EGR = TIM_EGR_UG;
+	}
+}
+
+// Programs every scheduled sensor's outer loop count and measurement delay
+// once and lets them repeat measurements by themselves. TIM7 then only reads
+// the sample bursts, one transaction per sample instead of trigger + polls.
+int8_t lidar_start_continuous(uint16_t rate_hz)
+{
+	uint16_t delay = LIDAR_MEASURE_DELAY_HZ / (rate_hz ? rate_hz : 1);
+	if (delay == 0)
+	{
+		delay = 1;
+	}
+	else if (delay > 0xFF)
+	{
+		delay = 0xFF;
+	}
+
+	lidar_acq_stop();
+	if (lidar_acq_drain()) // let samples in flight finish
+	{
+		return -1;
+	}
+	lidar_acq_use_default();
+
+	for (uint8_t i = 0; i < lidar_acq_count; i++)
+	{
+		lidar_t *dev = lidar_acq_devs[i];
+		if (lidar_dev_write_reg(dev, LIDAR_OUTER_LOOP_COUNT_REG, LIDAR_OUTER_LOOP_CONTINUOUS) ||
+				lidar_dev_write_reg(dev, LIDAR_MEASURE_DELAY_REG, delay) ||
+				lidar_dev_write_reg(dev, LIDAR_ACQ_CONFIG_REG, dev->config | LIDAR_ACQ_CONFIG_USE_DELAY) ||
+				lidar_dev_write_reg(dev, LIDAR_ACQ_COMMAND_REG, LIDAR_ACQ_COMMAND_VAL))
+		{
+			return -1;
+		}
+	}
+
+	lidar_acq_measure_delay = delay;
+	lidar_acq_continuous = 1;
+	lidar_acq_bias_count = 0;
+	lidar_acq_start(rate_hz);
+	return 0;
+}
+
+// Stops reading and puts the sensors back into one measurement per trigger.
+int8_t lidar_stop_continuous(void)
+{
+	int8_t result = 0;
+
+	lidar_acq_stop();
+	if (lidar_acq_drain())
+	{
+		result = -1; // the register writes below still queue behind it
+	}
+	lidar_acq_continuous = 0;
+
+	for (uint8_t i = 0; i < lidar_acq_count; i++)
+	{
+		lidar_t *dev = lidar_acq_devs[i];
+		if (lidar_dev_write_reg(dev, LIDAR_OUTER_LOOP_COUNT_REG, LIDAR_OUTER_LOOP_SINGLE) ||
+				lidar_dev_write_reg(dev, LIDAR_ACQ_CONFIG_REG, dev->config))
+		{
+			result = -1;
+		}
+	}
+	return result;
+}
+
+int8_t lidar_use_ready_pin(uint8_t enable)
+{
+	return lidar_dev_use_ready_pin(&lidar_default, enable);
+}
+
+// Puts the sensor's MODE pin into status output mode and takes the falling
+// edge on LIDAR_READY_PIN as measurement complete. The triggered acquisition
+// then reads that sensor's burst once per sample instead of polling the busy
+// bit. There is one ready input, so only one sensor can use it; continuous
+// mode does not use the pin, its reads stay on the TIM7 schedule.
+int8_t lidar_dev_use_ready_pin(lidar_t *dev, uint8_t enable)
+{
+	uint8_t config = dev->config & ~LIDAR_ACQ_CONFIG_MODE_MASK;
+	if (enable)
+	{
+		config |= LIDAR_ACQ_CONFIG_MODE_STATUS;
+	}
+	if (lidar_dev_write_reg(dev, LIDAR_ACQ_CONFIG_REG, config))
+	{
+		return -1;
+	}
+	dev->config = config;
+
+	if (enable)
+	{
+		RCC->AHBENR |= RCC_AHBENR_GPIOCEN;
+		RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+		LIDAR_READY_PORT->MODER &= ~GPIO_MODER_MODER0; // input
+		LIDAR_READY_PORT->PUPDR &= ~GPIO_PUPDR_PUPDR0;
+		SYSCFG->EXTICR[0] = (SYSCFG->EXTICR[0] & ~SYSCFG_EXTICR1_EXTI0) | LIDAR_READY_EXTICR_PORT;
+		EXTI->FTSR |= EXTI_FTSR_TR0;
+		EXTI->RTSR &= ~EXTI_RTSR_TR0;
+		EXTI->PR = EXTI_PR_PR0;
+		EXTI->IMR |= EXTI_IMR_MR0;
+		// same priority as the I2C buses so the edge and the trigger completion never preempt each other
+		HAL_NVIC_SetPriority(EXTI0_1_IRQn, I2C_IRQ_PRIORITY, 0);
+		HAL_NVIC_EnableIRQ(EXTI0_1_IRQn);
+		lidar_ready_dev = dev;
+	}
+	else
+	{
+		EXTI->IMR &= ~EXTI_IMR_MR0;
+		lidar_ready_dev = 0;
+	}
+	return 0;
+}
+
+void EXTI0_1_IRQHandler(void)
+{
+	lidar_t *dev = lidar_ready_dev;
+
+	EXTI->PR = EXTI_PR_PR0;
+	if (dev == 0)
+	{
+		return;
+	}
+	if (dev->state == LIDAR_ACQ_WAIT)
+	{
+		schedule_cancel(dev->wait_slot);
+		lidar_acq_submit(dev, LIDAR_ACQ_READ, 1, LIDAR_BURST_LEN);
+	}
+	else if (dev->state == LIDAR_ACQ_TRIGGER)
+	{
+		lidar_ready_early = 1;
+	}
+}
+
+// The MODE pin edge never came. Runs from TIM2 below the I2C and EXTI
+// priority, so the edge may have won the race in the meantime.
+static void lidar_ready_timeout(void *context)
+{
+	lidar_t *dev = context;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (dev->state == LIDAR_ACQ_WAIT)
+	{
+		lidar_acq_fail(dev);
+	}
+	__set_PRIMASK(primask);
 }
 
 void lidar_test_start_stop()
 {
 	while(1)
 	{
-		i2c1_wait_idle();
-		i2c1_start(lidar_addr, 0, 0);
+		i2c_wait_idle(lidar_default.bus);
+		i2c_start(lidar_default.bus, lidar_default.addr, 0, 0);
 		int x = 0;
 		while ((I2C1->ISR & I2C_ISR_TC) == 0 &&
 				(I2C1->ISR & I2C_ISR_STOPF) == 0 &&
@@ -263,8 +833,8 @@ void lidar_test_start_stop()
 		if (I2C1->ISR & I2C_ISR_STOPF)
 			I2C1->ICR |= I2C_ICR_STOPCF;
 		else
-			i2c1_stop();
-		nano_wait(1000000);
+			i2c_stop(lidar_default.bus);
+		delay_us(1000);
 	}
 
 }
@@ -273,7 +843,7 @@ void lidar_test_send_one() // test sending data once
 {
 	uint8_t init_data[1];
 	init_data[0] = LIDAR_ACQ_COMMAND_REG;
-	i2c1_send_data(lidar_addr, init_data, sizeof(init_data));
+	i2c_send_data(lidar_default.bus, lidar_default.addr, init_data, sizeof(init_data));
 }
 
 void lidar_test_send_many() // test sending data once
@@ -285,10 +855,10 @@ void lidar_test_read_one()
 {
 	//lidar_init_dist_measure();
 	uint8_t reg_addr[] = {LIDAR_STATUS_REG};
-	i2c1_send_data(lidar_addr, reg_addr, sizeof(reg_addr));
+	i2c_send_data(lidar_default.bus, lidar_default.addr, reg_addr, sizeof(reg_addr));
 
 	uint8_t busy[] = {1};
-	i2c1_recv_data(lidar_addr, busy, sizeof(busy));
+	i2c_recv_data(lidar_default.bus, lidar_default.addr, busy, sizeof(busy));
 }
 
 void lidar_test_get_one_distance()
@@ -298,10 +868,29 @@ void lidar_test_get_one_distance()
 }
 
 
-void nano_wait(unsigned int n) {
-    asm(    "        mov r0,%0\n"
-            "repeat: sub r0,#83\n"
-            "        bgt repeat\n" : : "r"(n) : "r0", "cc");
+// Runs the triggered acquisition faster than the sensor can follow for one
+// second with bias correction on every sample, then for one second with the
+// default schedule, and returns the achieved samples per second of each.
+void lidar_test_bias_rate(uint32_t* pcorrected_sps, uint32_t* pscheduled_sps)
+{
+	lidar_acq_stats_t before, after;
+	lidar_sample_t sample;
+	uint16_t intervals[] = {1, LIDAR_BIAS_INTERVAL_DEFAULT};
+	uint32_t* presults[] = {pcorrected_sps, pscheduled_sps};
+
+	for (int i = 0; i < 2; i++)
+	{
+		lidar_acq_set_bias_interval(intervals[i]);
+		lidar_acq_get_stats(&before);
+		lidar_acq_start(1000);
+		HAL_Delay(1000);
+		lidar_acq_stop();
+		lidar_acq_drain();
+		lidar_acq_get_stats(&after);
+		while (lidar_acq_read(&sample)); // discard the test samples
+		*presults[i] = after.samples - before.samples;
+	}
+	lidar_acq_set_bias_interval(LIDAR_BIAS_INTERVAL_DEFAULT);
 }
 
 /* USER CODE END 0 */
@@ -20,6 +20,11 @@
 #include "main.h"
 #include "uart.h"
 #include "lidar.h"
+#include "imu.h"
+#include "timebase.h"
+#include "filter.h"
+#include "fusion.h"
+#include "bench.h"
 #include "lcd.h"
 #include "keypad.h"
 #include <stdio.h>
@@ -37,6 +42,11 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define STREAM_FUSED 1 // fused estimates instead of the raw LIDAR and IMU streams; raw LIDAR regardless without an IMU
+#define LIDAR_BATCH 8 // samples per raw LIDAR frame
+#define LIDAR_BATCH_WORDS 5 // distance, range rate, t_complete low and high word, t_complete - t_trigger (us, saturates)
+#define FUSED_WORDS 6 // range, range rate, pitch, roll, t low and high word
+#define LIDAR_COMPRESSED 1 // raw LIDAR frames as UART_DELTA_VARINT, each word against the previous sample's
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -48,12 +58,25 @@
 
 /* USER CODE BEGIN PV */
 int time_remaining = 0;
+filter_chain_t lidar_filters[LIDAR_MAX_SENSORS]; // one chain per sensor, indexed by sample.sensor
+uint8_t imu_ready = 0; // imu_init() found the sensor
+uint16_t lidar_batch[LIDAR_BATCH * LIDAR_BATCH_WORDS];
+uint8_t lidar_batch_len = 0; // words
+
+// a batch fits one frame as plain words and, at worst, as UART_DELTA_VARINT
+_Static_assert(2 * LIDAR_BATCH * LIDAR_BATCH_WORDS <= UART_FRAME_PAYLOAD_MAX &&
+		1 + UART_VARINT_MAX * LIDAR_BATCH * LIDAR_BATCH_WORDS <= UART_FRAME_PAYLOAD_MAX, "LIDAR batch does not fit a frame");
+
+// the fused stream may take at most half the default link (10 bits per byte)
+_Static_assert((UART_FRAME_OVERHEAD + 2 * FUSED_WORDS) * (IMU_ODR_HZ / FUSION_OUTPUT_DECIMATE) <= UART_BAUD_DEFAULT / 10 / 2,
+		"fused frames do not fit the default baud rate, raise FUSION_OUTPUT_DECIMATE");
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 /* USER CODE BEGIN PFP */
-
+static void command_start(const uint8_t* pframe, uint16_t size);
+static void command_stop(const uint8_t* pframe, uint16_t size);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -89,12 +112,19 @@ int main(void)
 
   /* Initialize all configured peripherals */
   /* USER CODE BEGIN 2 */
+  timebase_init(); // sample timestamps
   uart3_init();
-  //lidar_init();
+  uart3_set_command_handler(UART_COM_START_DATA_COLLECTION, command_start);
+  uart3_set_command_handler(UART_COM_STOP_DATA_COLLECTION, command_stop);
+  lidar_init();
   LCD_Setup();
   Keypad_Init();
 
   //uart3_test();
+#if BENCH_MODE
+  bench_run_all();
+  while (1);
+#endif
 
   init_spi2();
   spi2_init_oled();
@@ -107,34 +137,51 @@ int main(void)
   //lidar_test_read_one();  // passes. scope verified
   //lidar_wait_for_data(); // passes. scope verified
   //lidar_test_get_one_distance(); // passes. scope verified. Reading takes a long time to be ready
+  //lidar_acq_start(LIDAR_ACQ_DEFAULT_RATE_HZ); // free-running acquisition, drained in the main loop
+  //lidar_acq_set_adaptive(20, LIDAR_ACQ_DEFAULT_RATE_HZ); // back off to 20 Hz on a static scene
+  if (imu_init() == 0) // IMU FIFO on I2C2, started with the LIDAR by the host's start command
+  {
+    imu_ready = 1;
+  }
+  for (int i = 0; i < LIDAR_MAX_SENSORS; i++)
+  {
+    filter_init(&lidar_filters[i], FILTER_ALL, 1);
+  }
+  fusion_init();
+  /*
+  filter_bench_t bench;
+  char bench_string[48];
+  filter_test_cycles(&bench);
+  sprintf(bench_string, "median %lu ema %lu kalman %lu\n\r", bench.median_cycles, bench.ema_cycles, bench.kalman_cycles);
+  uart3_send_string(bench_string);
+  sprintf(bench_string, "chain %lu max %lu cycles\n\r", bench.chain_cycles, bench.chain_max_cycles);
+  uart3_send_string(bench_string);
+  */
+  /*
+  uint32_t corrected_sps, scheduled_sps;
+  char rate_string[40];
+  lidar_test_bias_rate(&corrected_sps, &scheduled_sps);
+  sprintf(rate_string, "bias every sample: %lu/s\n\r", corrected_sps);
+  uart3_send_string(rate_string);
+  sprintf(rate_string, "bias every %d: %lu/s\n\r", LIDAR_BIAS_INTERVAL_DEFAULT, scheduled_sps);
+  uart3_send_string(rate_string);
+  */
   /*
 #define LIDAR_BUFFER_SIZE 200
   uart3_test();
 
-  // UART buffer for lidar data
-  uint8_t header[2];
-  uart3_create_header(header, UART_COM_NONE, UART_DATA_SOURCE_LIDAR, UART_UINT16_T, LIDAR_BUFFER_SIZE);
-
-  char dist_string[8];
-
-  // send header as string
-  sprintf(dist_string, "%d", header[0]);
-  uart3_send_string(dist_string);
-  uart3_send_string("\n\r");
-
-  sprintf(dist_string, "%d", header[1]);
-  uart3_send_string(dist_string);
-  uart3_send_string("\n\r");
-
-  // read lidar data into buffer and send as string
+  // read lidar data into buffer and send as binary frames of up to
+  // UART_FRAME_PAYLOAD_MAX / 2 distances each
   uint16_t dist[LIDAR_BUFFER_SIZE];
   for (int i = 0; i < LIDAR_BUFFER_SIZE; i++) {
 	  lidar_get_distance(&dist[i]);
-
-	  // send over uart as string
-	  sprintf(dist_string, "%d", dist[i]);
-	  uart3_send_string(dist_string);
-	  uart3_send_string("\n\r");
+  }
+  for (int i = 0; i < LIDAR_BUFFER_SIZE; i += UART_FRAME_PAYLOAD_MAX / 2) {
+	  int n = LIDAR_BUFFER_SIZE - i;
+	  if (n > UART_FRAME_PAYLOAD_MAX / 2) {
+		  n = UART_FRAME_PAYLOAD_MAX / 2;
+	  }
+	  uart3_send_frame(UART_COM_NONE, UART_DATA_SOURCE_LIDAR, UART_UINT16_T, &dist[i], n);
   }
   */
   /* USER CODE END 2 */
@@ -146,6 +193,75 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    uart3_dispatch(); // host commands
+
+    lidar_sample_t sample;
+    while (lidar_acq_read(&sample))
+    {
+      if (sample.sensor == FUSION_LIDAR_SENSOR)
+      {
+        fusion_update_lidar(sample.distance, sample.t_complete);
+      }
+      if (STREAM_FUSED && imu_ready)
+      {
+        continue; // the LIDAR only feeds the fused stream
+      }
+      uint16_t distance;
+      if (!filter_apply(&lidar_filters[sample.sensor], sample.distance, &distance))
+      {
+        continue; // decimated away
+      }
+      uint16_t *pbatch = &lidar_batch[lidar_batch_len];
+      pbatch[0] = distance;
+      pbatch[1] = sample.rate;
+      pbatch[2] = sample.t_complete & 0xFFFF;
+      pbatch[3] = sample.t_complete >> 16;
+      uint32_t latency = sample.t_complete - sample.t_trigger;
+      pbatch[4] = (latency > 0xFFFF) ? 0xFFFF : latency;
+      lidar_batch_len += LIDAR_BATCH_WORDS;
+      if (lidar_batch_len >= LIDAR_BATCH * LIDAR_BATCH_WORDS)
+      {
+#if LIDAR_COMPRESSED
+        uart3_send_frame_delta(UART_COM_NONE, UART_DATA_SOURCE_LIDAR, lidar_batch, lidar_batch_len, LIDAR_BATCH_WORDS);
+#else
+        uart3_send_frame(UART_COM_NONE, UART_DATA_SOURCE_LIDAR, UART_UINT16_T, lidar_batch, lidar_batch_len);
+#endif
+        lidar_batch_len = 0;
+      }
+    }
+
+    imu_sample_t imu_sample;
+#if STREAM_FUSED
+    fusion_state_t fused;
+    while (imu_read(&imu_sample))
+    {
+      if (!fusion_update_imu(&imu_sample, &fused))
+      {
+        continue;
+      }
+      // range, range-rate, pitch, roll, then the sample time in us as low
+      // and high word
+      uint16_t words[FUSED_WORDS] = {fused.range, fused.rate, fused.pitch, fused.roll, fused.t & 0xFFFF, fused.t >> 16};
+      uart3_send_frame(UART_COM_NONE, UART_DATA_SOURCE_FUSION, UART_UINT16_T, words, FUSED_WORDS);
+    }
+#else
+    while (imu_read(&imu_sample))
+    {
+      // gyro x,y,z, accel x,y,z, then sample and completion time in us as
+      // low and high word each
+      uint16_t words[10];
+      for (int i = 0; i < 3; i++)
+      {
+        words[i] = imu_sample.gyro[i];
+        words[3 + i] = imu_sample.accel[i];
+      }
+      words[6] = imu_sample.t_sample & 0xFFFF;
+      words[7] = imu_sample.t_sample >> 16;
+      words[8] = imu_sample.t_complete & 0xFFFF;
+      words[9] = imu_sample.t_complete >> 16;
+      uart3_send_frame(UART_COM_NONE, UART_DATA_SOURCE_IMU, UART_UINT16_T, words, 10);
+    }
+#endif
   }
   /* USER CODE END 3 */
 }
@@ -185,6 +301,29 @@ void SystemClock_Config(void)
 }
 
 /* USER CODE BEGIN 4 */
+// host commands, from uart3_dispatch() in the main loop
+static void command_start(const uint8_t* pframe, uint16_t size)
+{
+	(void)pframe;
+	(void)size;
+	lidar_acq_start(LIDAR_ACQ_DEFAULT_RATE_HZ);
+	if (imu_ready)
+	{
+		imu_start();
+	}
+}
+
+static void command_stop(const uint8_t* pframe, uint16_t size)
+{
+	(void)pframe;
+	(void)size;
+	lidar_acq_stop();
+	if (imu_ready)
+	{
+		imu_stop();
+	}
+}
+
 void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
 	if(GPIO_Pin == GPIO_PIN_8){
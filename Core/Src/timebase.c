@@ -0,0 +1,172 @@
+/* USER CODE BEGIN Header */
+/**
+  ******************************************************************************
+  * @file           : timebase.c
+  * @brief          : 32 bit microsecond timebase for sample timestamps
+  ******************************************************************************
+  * @attention
+  *
+  * Copyright (c) 2022 STMicroelectronics.
+  * All rights reserved.
+  *
+  * This software is licensed under terms that can be found in the LICENSE file
+  * in the root directory of this software component.
+  * If no LICENSE file comes with this software, it is provided AS-IS.
+  *
+  ******************************************************************************
+  */
+/* USER CODE END Header */
+/* Includes ------------------------------------------------------------------*/
+
+/* Private includes ----------------------------------------------------------*/
+/* USER CODE BEGIN Includes */
+#include "timebase.h"
+/* USER CODE END Includes */
+
+/* Private typedef -----------------------------------------------------------*/
+/* USER CODE BEGIN PTD */
+
+/* USER CODE END PTD */
+
+/* Private define ------------------------------------------------------------*/
+/* USER CODE BEGIN PD */
+
+/* USER CODE END PD */
+
+/* Private macro -------------------------------------------------------------*/
+/* USER CODE BEGIN PM */
+
+/* USER CODE END PM */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* USER CODE BEGIN PV */
+// callback of each compare channel, 0 while the slot is free
+static timebase_callback_t timebase_callbacks[TIMEBASE_SLOTS];
+static void *timebase_contexts[TIMEBASE_SLOTS];
+/* USER CODE END PV */
+
+/* Private function prototypes -----------------------------------------------*/
+
+/* USER CODE BEGIN PFP */
+
+/* USER CODE END PFP */
+
+/* Private user code ---------------------------------------------------------*/
+/* USER CODE BEGIN 0 */
+// TIM2 is the only 32 bit timer on the F0. Run it from the APB clock
+// divided down to 1 MHz over the full 32 bit range. The counter never stops
+// for the compare channels, they only raise interrupts for schedule_after().
+void timebase_init(void)
+{
+	RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+	TIM2->CR1 &= ~TIM_CR1_CEN;
+	TIM2->DIER = 0;
+	TIM2->PSC = SystemCoreClock / TIMEBASE_HZ - 1;
+	TIM2->ARR = 0xFFFFFFFF;
+	TIM2->CNT = 0;
+	TIM2->EGR = TIM_EGR_UG; // load PSC now
+	TIM2->SR = 0;
+	TIM2->CR1 |= TIM_CR1_CEN;
+
+	for (int i = 0; i < TIMEBASE_SLOTS; i++)
+	{
+		timebase_callbacks[i] = 0;
+	}
+	HAL_NVIC_SetPriority(TIM2_IRQn, TIMEBASE_IRQ_PRIORITY, 0);
+	NVIC_EnableIRQ(TIM2_IRQn);
+}
+
+// Waits at least us microseconds whatever SYSCLK is. From thread mode the
+// core sleeps until the next interrupt while the wait is long; interrupt
+// handlers spin, a lower priority interrupt would never wake them.
+void delay_us(uint32_t us)
+{
+	if ((TIM2->CR1 & TIM_CR1_CEN) == 0)
+	{
+		timebase_init(); // callers that run before main() gets to it
+	}
+
+	uint32_t start = timebase_us();
+	uint32_t elapsed;
+	while ((elapsed = timebase_us() - start) < us)
+	{
+		if (us - elapsed > TIMEBASE_SLEEP_MIN_US && __get_IPSR() == 0)
+		{
+			__WFI();
+		}
+	}
+}
+
+// Calls callback(context) from the TIM2 interrupt us microseconds from now,
+// so the caller can carry on instead of waiting. Returns the slot to cancel
+// it with.
+int8_t schedule_after(uint32_t us, timebase_callback_t callback, void *context)
+{
+	int8_t slot = -1;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	for (int i = 0; i < TIMEBASE_SLOTS; i++)
+	{
+		if (timebase_callbacks[i] == 0)
+		{
+			slot = i;
+			break;
+		}
+	}
+	if (slot >= 0)
+	{
+		uint32_t ccif = TIM_SR_CC1IF << slot;
+		uint32_t start = timebase_us();
+		timebase_callbacks[slot] = callback;
+		timebase_contexts[slot] = context;
+		(&TIM2->CCR1)[slot] = start + us;
+		TIM2->SR = ~ccif;
+		TIM2->DIER |= TIM_DIER_CC1IE << slot;
+
+		// a deadline this close may already be behind the counter, the compare
+		// would then only match after the 32 bit wrap
+		if (timebase_us() - start >= us && (TIM2->SR & ccif) == 0)
+		{
+			TIM2->EGR = TIM_EGR_CC1G << slot;
+		}
+	}
+	__set_PRIMASK(primask);
+	return slot;
+}
+
+void schedule_cancel(int8_t slot)
+{
+	if (slot < 0 || slot >= TIMEBASE_SLOTS)
+	{
+		return;
+	}
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	TIM2->DIER &= ~(TIM_DIER_CC1IE << slot);
+	TIM2->SR = ~(TIM_SR_CC1IF << slot);
+	timebase_callbacks[slot] = 0;
+	__set_PRIMASK(primask);
+}
+
+void TIM2_IRQHandler(void)
+{
+	uint32_t sr = TIM2->SR & TIM2->DIER;
+
+	for (int i = 0; i < TIMEBASE_SLOTS; i++)
+	{
+		if (sr & (TIM_SR_CC1IF << i))
+		{
+			timebase_callback_t callback = timebase_callbacks[i];
+			TIM2->DIER &= ~(TIM_DIER_CC1IE << i);
+			TIM2->SR = ~(TIM_SR_CC1IF << i);
+			timebase_callbacks[i] = 0; // free before the call so it can reschedule itself
+			if (callback)
+			{
+				callback(timebase_contexts[i]);
+			}
+		}
+	}
+}
+/* USER CODE END 0 */
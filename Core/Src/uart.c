@@ -21,6 +21,7 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "uart.h"
+#include <string.h>
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -40,13 +41,51 @@
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
-
+// TX ring: producers advance head with interrupts masked, the DMA interrupt
+// advances tail as bytes leave. Both run freely and are masked on access.
+static uint8_t uart3_tx_ring[UART_TX_RING_SIZE];
+static volatile uint16_t uart3_tx_head = 0;
+static volatile uint16_t uart3_tx_tail = 0;
+static volatile uint16_t uart3_tx_dma_start = 0;	// tail when the running chunk was started
+static volatile uint16_t uart3_tx_dma_len = 0;		// bytes in the running chunk, 0 while DMA is idle
+static uint8_t uart3_tx_policy = UART_TX_POLICY_DEFAULT;
+static volatile uint32_t uart3_tx_dropped = 0;
+
+// RX: DMA fills rx_dma circularly, the interrupts copy what arrived since
+// rx_pos into the frame being assembled and an idle line closes it into the
+// frame queue. The main loop empties the queue in uart3_dispatch().
+static uint8_t uart3_rx_dma[UART_RX_DMA_SIZE];
+static uint16_t uart3_rx_pos = 0;
+static uint8_t uart3_rx_frame[UART_RX_FRAME_MAX];
+static uint16_t uart3_rx_frame_len = 0;		// may run past UART_RX_FRAME_MAX, the frame is then dropped
+static uint8_t uart3_rx_frames[UART_RX_FRAMES][UART_RX_FRAME_MAX];
+static uint8_t uart3_rx_frame_lens[UART_RX_FRAMES];
+static volatile uint8_t uart3_rx_head = 0;
+static volatile uint8_t uart3_rx_tail = 0;
+static volatile uint32_t uart3_rx_errors = 0;
+static uart_command_handler_t uart3_handlers[UART_COM_COUNT];
+
+static uint8_t uart3_tx_seq = 0;
+
+static uint32_t uart3_baud = UART_BAUD_DEFAULT;
+static uint32_t uart3_baud_fallback = 0;	// rate to return to, 0 unless a switch waits for its probe
+static uint32_t uart3_baud_deadline;		// HAL_GetTick() by which the probe must arrive
+
+// CRC-16-CCITT a nibble at a time, 32 bytes of table instead of 512
+static const uint16_t uart_crc_table[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 
 /* USER CODE BEGIN PFP */
-
+static void uart3_tx_kick(void);
+static void uart3_rx_collect(uint8_t frame_end);
+static int8_t uart3_brr(uint32_t baud, uint32_t* pbrr, uint8_t* pover8);
+static void uart3_baud_reply(uint16_t status, uint32_t baud);
+static void uart3_baud_command(const uint8_t* pframe, uint16_t size);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -80,12 +119,38 @@ void uart3_init(void) {
 	USART3->CR1 &= ~(0x3<<28);				// Set word length (M0) to 1 Start bit, 8 data bits, n stop bits
 	USART3->CR2 &= ~(0x3<<12);				// Set stop bit to 1
 	USART3->CR1 &= ~USART_CR1_PCE;			// Disable parity control
-	USART3->CR1 &= ~USART_CR1_OVER8;		// Set oversampling by 16
-	USART3->BRR = 0x1a1;					// Set baud rate to 115200 bits/s (0x1a1 = 417 = 48000000 / 115200)
+	uart3_set_baud(UART_BAUD_DEFAULT);		// Set baud rate to 115200 bits/s (BRR = 417 = 48000000 / 115200)
 	USART3->CR1 |= 1<<2;					// Receiver is enabled
 	USART3->CR1 |= 1<<3;					// Transmitter is enabled
+	USART3->CR3 |= USART_CR3_DMAT;			// TDR is fed by DMA1 channel 7
+	USART3->CR3 |= USART_CR3_DMAR;			// RDR is emptied by DMA1 channel 6
+	USART3->CR3 |= USART_CR3_EIE;			// overrun, noise and framing errors interrupt
+	USART3->CR1 |= USART_CR1_IDLEIE;		// idle line ends a host frame
 	USART3->CR1 |= 1;						// Enable UE (USART3)
 
+	RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+	DMA1->CSELR = (DMA1->CSELR & ~(DMA_CSELR_C6S | DMA_CSELR_C7S)) | DMA1_CSELR_CH6_USART3_RX | DMA1_CSELR_CH7_USART3_TX;
+	DMA1_Channel7->CCR = 0;
+	DMA1_Channel7->CPAR = (uint32_t)&USART3->TDR;
+	uart3_tx_head = uart3_tx_tail = 0;
+	uart3_tx_dma_len = 0;
+
+	// RX never stops: circular, with half and full interrupts so the buffer
+	// is emptied before it laps even when the line never goes idle
+	DMA1_Channel6->CCR = 0;
+	DMA1_Channel6->CPAR = (uint32_t)&USART3->RDR;
+	DMA1_Channel6->CMAR = (uint32_t)uart3_rx_dma;
+	DMA1_Channel6->CNDTR = UART_RX_DMA_SIZE;
+	DMA1_Channel6->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+	uart3_rx_pos = 0;
+	uart3_rx_frame_len = 0;
+
+	HAL_NVIC_SetPriority(DMA1_Ch4_7_DMA2_Ch3_5_IRQn, UART_DMA_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Ch4_7_DMA2_Ch3_5_IRQn);
+	HAL_NVIC_SetPriority(USART3_8_IRQn, UART_DMA_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(USART3_8_IRQn);
+	uart3_handlers[UART_COM_SET_BAUD] = uart3_baud_command;
+
 	while(((USART3->ISR & USART_ISR_REACK) != USART_ISR_REACK) && ((USART3->ISR & USART_ISR_TEACK) != USART_ISR_TEACK));
 
 }
@@ -99,18 +164,452 @@ void uart3_create_header(uint8_t* pheader, uint8_t command, uint8_t d_source, ui
 	pheader[1] = num_data;
 }
 
+uint8_t uart_type_size(uint8_t d_type) {
+
+	switch (d_type & (UART_DATA_TYPE_MASK)) {
+	case UART_UINT8_T:
+		return 1;
+	case UART_UINT16_T:
+		return 2;
+	default:
+		return 0;
+	}
+
+}
+
+uint16_t uart_crc16(const uint8_t* pdata, uint16_t size, uint16_t crc) {
+
+	while (size--) {
+		uint8_t b = *pdata++;
+		crc = (crc << 4) ^ uart_crc_table[(crc >> 12) ^ (b >> 4)];
+		crc = (crc << 4) ^ uart_crc_table[(crc >> 12) ^ (b & 0x0F)];
+	}
+	return crc;
+
+}
+
+// Builds a whole frame in pframe, which needs room for UART_FRAME_MAX bytes
+// or num_data values plus UART_FRAME_OVERHEAD. pdata holds num_data values
+// of d_type in native order.
+int16_t uart3_frame_encode(uint8_t* pframe, uint8_t command, uint8_t d_source, uint8_t d_type, const void* pdata, uint8_t num_data) {
+
+	uint8_t size = uart_type_size(d_type);
+	uint16_t payload = size * num_data;
+	uint8_t *p = pframe;
+
+	if (size == 0 || payload > UART_FRAME_PAYLOAD_MAX) {
+		return -1;
+	}
+
+	*p++ = UART_FRAME_SYNC;
+	uart3_create_header(p, command, d_source, d_type, num_data);
+	p += 2;
+	*p++ = uart3_tx_seq++;
+	if (size == 1) {
+		memcpy(p, pdata, payload);
+		p += payload;
+	} else {
+		const uint16_t *pvalues = pdata;
+		for (uint8_t i = 0; i < num_data; i++) {
+			*p++ = pvalues[i] & 0xFF;
+			*p++ = pvalues[i] >> 8;
+		}
+	}
+
+	uint16_t crc = uart_crc16(pframe + 1, p - pframe - 1, UART_CRC_INIT);
+	*p++ = crc & 0xFF;
+	*p++ = crc >> 8;
+	return p - pframe;
+
+}
+
+// Same frame with a UART_DELTA_VARINT payload. The length depends on the
+// data, so the check against UART_FRAME_PAYLOAD_MAX happens while packing;
+// up to UART_FRAME_PAYLOAD_MAX / UART_VARINT_MAX values always fit.
+int16_t uart3_frame_encode_delta(uint8_t* pframe, uint8_t command, uint8_t d_source, const uint16_t* pvalues, uint8_t num_data, uint8_t stride) {
+
+	uint8_t *p = pframe;
+	uint8_t *pend = pframe + 4 + UART_FRAME_PAYLOAD_MAX;
+
+	if (stride == 0) {
+		return -1;
+	}
+
+	*p++ = UART_FRAME_SYNC;
+	uart3_create_header(p, command, d_source, UART_DELTA_VARINT, num_data);
+	p += 2;
+	*p++ = uart3_tx_seq;
+	*p++ = stride;
+	for (uint8_t i = 0; i < num_data; i++) {
+		int16_t delta = pvalues[i] - ((i < stride) ? 0 : pvalues[i - stride]);
+		uint16_t zigzag = ((uint16_t)delta << 1) ^ (uint16_t)(delta >> 15);
+		while (1) {
+			if (p >= pend) {
+				return -1;
+			}
+			if (zigzag < 0x80) {
+				*p++ = zigzag;
+				break;
+			}
+			*p++ = (zigzag & 0x7F) | 0x80;
+			zigzag >>= 7;
+		}
+	}
+	uart3_tx_seq++;							// only frames that made it count, as in uart3_frame_encode()
+
+	uint16_t crc = uart_crc16(pframe + 1, p - pframe - 1, UART_CRC_INIT);
+	*p++ = crc & 0xFF;
+	*p++ = crc >> 8;
+	return p - pframe;
+
+}
+
+int8_t uart3_send_frame_delta(uint8_t command, uint8_t d_source, const uint16_t* pvalues, uint8_t num_data, uint8_t stride) {
+
+	uint8_t frame[UART_FRAME_MAX];
+	int16_t len = uart3_frame_encode_delta(frame, command, d_source, pvalues, num_data, stride);
+
+	if (len < 0 || uart3_write(frame, len) != len) {
+		return -1;
+	}
+	return 0;
+
+}
+
+int8_t uart3_send_frame(uint8_t command, uint8_t d_source, uint8_t d_type, const void* pdata, uint8_t num_data) {
+
+	uint8_t frame[UART_FRAME_MAX];
+	int16_t len = uart3_frame_encode(frame, command, d_source, d_type, pdata, num_data);
+
+	if (len < 0 || uart3_write(frame, len) != len) {
+		return -1;
+	}
+	return 0;
+
+}
+
 void uart3_send_byte(uint8_t c) {
 
-	while((USART3->ISR & USART_ISR_TXE) != USART_ISR_TXE);
-	USART3->TDR = c;
-	while((USART3->ISR & USART_ISR_TXE) != USART_ISR_TXE);
+	uart3_write(&c, 1);
 
 }
 
 void uart3_send_string(char * str) {
 
-	while(*str) {
-		uart3_send_byte(*str++);
+	uart3_write(str, strlen(str));
+
+}
+
+// Copies the bytes into the TX ring and starts the DMA if it is idle, so it
+// is safe and quick from interrupt handlers. A write that does not fit is
+// dropped whole under UART_TX_DROP, so a frame is never cut in half; under
+// UART_TX_BLOCK the caller waits for room, except in an interrupt handler
+// or with interrupts masked, where the DMA interrupt might never get to run.
+uint16_t uart3_write(const void* pdata, uint16_t size) {
+
+	const uint8_t *p = pdata;
+	uint16_t queued = 0;
+	uint8_t block = (uart3_tx_policy == UART_TX_BLOCK) && (__get_IPSR() == 0) && (__get_PRIMASK() == 0);
+
+	while (queued < size) {
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		uint16_t head = uart3_tx_head;
+		uint16_t space = UART_TX_RING_SIZE - (uint16_t)(head - uart3_tx_tail);
+		uint16_t n = size - queued;
+
+		if (n > space) {
+			if (!block) {
+				uart3_tx_dropped += n;
+				__set_PRIMASK(primask);
+				return queued;
+			}
+			n = space;
+		}
+		for (uint16_t i = 0; i < n; i++) {
+			uart3_tx_ring[(head + i) & (UART_TX_RING_SIZE - 1)] = p[queued + i];
+		}
+		uart3_tx_head = head + n;
+		queued += n;
+		uart3_tx_kick();
+		__set_PRIMASK(primask);
+	}
+	return queued;
+
+}
+
+void uart3_set_overflow_policy(uint8_t policy) {
+
+	uart3_tx_policy = policy;
+
+}
+
+uint32_t uart3_get_tx_dropped(void) {
+
+	return uart3_tx_dropped;
+
+}
+
+// Thread mode only, it waits on the DMA interrupt.
+void uart3_flush(void) {
+
+	while (uart3_tx_head != uart3_tx_tail);
+	while ((USART3->ISR & USART_ISR_TC) != USART_ISR_TC);
+
+}
+
+// Starts the DMA on the next contiguous run of the ring, up to its end.
+// Called with interrupts masked or from the DMA interrupt.
+static void uart3_tx_kick(void) {
+
+	if (uart3_tx_dma_len != 0) {
+		return;
+	}
+	uint16_t tail = uart3_tx_tail;
+	uint16_t pending = uart3_tx_head - tail;
+	uint16_t offset = tail & (UART_TX_RING_SIZE - 1);
+	if (pending == 0) {
+		return;
+	}
+	if (pending > UART_TX_RING_SIZE - offset) {
+		pending = UART_TX_RING_SIZE - offset;		// wrap, the rest goes in the next chunk
+	}
+	uart3_tx_dma_start = tail;
+	uart3_tx_dma_len = pending;
+	DMA1_Channel7->CCR = 0;
+	DMA1_Channel7->CMAR = (uint32_t)&uart3_tx_ring[offset];
+	DMA1_Channel7->CNDTR = pending;
+	DMA1_Channel7->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_TEIE | DMA_CCR_EN;
+
+}
+
+// Copies what the RX DMA wrote since the last call into the frame being
+// assembled, and on an idle line queues it. Runs in the DMA and USART3
+// interrupts, which share a priority.
+static void uart3_rx_collect(uint8_t frame_end) {
+
+	uint16_t pos = UART_RX_DMA_SIZE - DMA1_Channel6->CNDTR;
+	if (pos == UART_RX_DMA_SIZE) {
+		pos = 0;
+	}
+
+	while (uart3_rx_pos != pos) {
+		if (uart3_rx_frame_len < UART_RX_FRAME_MAX) {
+			uart3_rx_frame[uart3_rx_frame_len] = uart3_rx_dma[uart3_rx_pos];
+		}
+		uart3_rx_frame_len++;
+		if (++uart3_rx_pos >= UART_RX_DMA_SIZE) {
+			uart3_rx_pos = 0;
+		}
+	}
+
+	if (!frame_end || uart3_rx_frame_len == 0) {
+		return;
+	}
+	uint8_t head = uart3_rx_head;
+	if (uart3_rx_frame_len > UART_RX_FRAME_MAX || (uint8_t)(head - uart3_rx_tail) >= UART_RX_FRAMES) {
+		uart3_rx_errors++;
+	} else {
+		memcpy(uart3_rx_frames[head & (UART_RX_FRAMES - 1)], uart3_rx_frame, uart3_rx_frame_len);
+		uart3_rx_frame_lens[head & (UART_RX_FRAMES - 1)] = uart3_rx_frame_len;
+		__DMB();								// frame must be visible before the new head
+		uart3_rx_head = head + 1;
+	}
+	uart3_rx_frame_len = 0;
+
+}
+
+void USART3_8_IRQHandler(void) {
+
+	uint32_t isr = USART3->ISR;
+
+	if (isr & (USART_ISR_ORE | USART_ISR_NE | USART_ISR_FE)) {
+		USART3->ICR = USART_ICR_ORECF | USART_ICR_NCF | USART_ICR_FECF;
+		uart3_rx_errors++;
+	}
+	if (isr & USART_ISR_IDLE) {
+		USART3->ICR = USART_ICR_IDLECF;
+		uart3_rx_collect(1);
+	}
+
+}
+
+// Handlers run in thread mode from uart3_dispatch(), so they may use the
+// blocking I2C calls. A command without a handler is ignored.
+void uart3_set_command_handler(uint8_t command, uart_command_handler_t handler) {
+
+	uart3_handlers[command & UART_COM_MASK] = handler;
+
+}
+
+// Binary frames (leading UART_FRAME_SYNC) must pass their CRC and reach the
+// handler without sync and CRC; anything else is passed on as a bare header.
+void uart3_dispatch(void) {
+
+	while (uart3_rx_tail != uart3_rx_head) {
+		uint8_t slot = uart3_rx_tail & (UART_RX_FRAMES - 1);
+		const uint8_t *pframe = uart3_rx_frames[slot];
+		uint16_t size = uart3_rx_frame_lens[slot];
+
+		if (pframe[0] == UART_FRAME_SYNC) {
+			if (size < UART_FRAME_OVERHEAD ||
+					uart_crc16(pframe + 1, size - 3, UART_CRC_INIT) != (pframe[size - 2] | (pframe[size - 1] << 8))) {
+				uart3_rx_errors++;
+				pframe = 0;
+			} else {
+				pframe++;
+				size -= 3;
+			}
+		}
+		if (pframe) {
+			uart_command_handler_t handler = uart3_handlers[pframe[0] & UART_COM_MASK];
+			if (handler) {
+				handler(pframe, size);
+			}
+		}
+		__DMB();								// done with the slot before handing it back
+		uart3_rx_tail++;
+	}
+
+	if (uart3_baud_fallback && (int32_t)(HAL_GetTick() - uart3_baud_deadline) >= 0) {
+		uart3_flush();							// frames queued since the switch go out whole before BRR changes
+		uart3_set_baud(uart3_baud_fallback);	// no probe at the new rate, the host must have failed to follow
+		uart3_baud_fallback = 0;
+	}
+
+}
+
+uint32_t uart3_get_rx_errors(void) {
+
+	return uart3_rx_errors;
+
+}
+
+// BRR for baud from the USART3 kernel clock, PCLK with the reset default
+// USART3SW. 16x oversampling as long as it reaches, 8x above that.
+static int8_t uart3_brr(uint32_t baud, uint32_t* pbrr, uint8_t* pover8) {
+
+	uint32_t fck = HAL_RCC_GetPCLK1Freq();
+	uint32_t div;
+	uint32_t actual;
+
+	if (baud == 0 || baud > UART_BAUD_MAX) {
+		return -1;
+	}
+	if (baud <= fck / 16) {
+		div = (fck + baud / 2) / baud;
+		actual = fck / div;
+		*pbrr = div;
+		*pover8 = 0;
+	} else {
+		div = (2 * fck + baud / 2) / baud;
+		actual = 2 * fck / div;
+		*pbrr = (div & 0xFFF0) | ((div & 0x000F) >> 1);
+		*pover8 = 1;
+	}
+	if (div < 16) {
+		return -1;
+	}
+	uint32_t error = (actual > baud) ? actual - baud : baud - actual;
+	return (error * 100 > baud * UART_BAUD_TOLERANCE_PCT) ? -1 : 0;
+
+}
+
+// Reprograms the rate on the fly. Bytes still queued go out at the new
+// rate, so callers switching under traffic flush first.
+int8_t uart3_set_baud(uint32_t baud) {
+
+	uint32_t brr;
+	uint8_t over8;
+
+	if (uart3_brr(baud, &brr, &over8)) {
+		return -1;
+	}
+
+	uint32_t enabled = USART3->CR1 & USART_CR1_UE;
+	USART3->CR1 &= ~USART_CR1_UE;			// BRR and OVER8 only change while disabled
+	if (over8) {
+		USART3->CR1 |= USART_CR1_OVER8;
+	} else {
+		USART3->CR1 &= ~USART_CR1_OVER8;
+	}
+	USART3->BRR = brr;
+	if (enabled) {
+		USART3->CR1 |= USART_CR1_UE;
+		while ((USART3->ISR & (USART_ISR_REACK | USART_ISR_TEACK)) != (USART_ISR_REACK | USART_ISR_TEACK));
+	}
+	uart3_baud = baud;
+	return 0;
+
+}
+
+uint32_t uart3_get_baud(void) {
+
+	return uart3_baud;
+
+}
+
+// Sends the answer to a baud request and waits until it is on the wire,
+// so a switch right after cannot garble it.
+static void uart3_baud_reply(uint16_t status, uint32_t baud) {
+
+	uint16_t words[3] = {status, baud & 0xFFFF, baud >> 16};
+	uart3_flush();
+	uart3_send_frame(UART_COM_SET_BAUD, 0, UART_UINT16_T, words, 3);
+	uart3_flush();
+
+}
+
+static void uart3_baud_command(const uint8_t* pframe, uint16_t size) {
+
+	// header, sequence, then the baud as two little-endian words
+	if (size < 7) {
+		return;
+	}
+	uint32_t baud = pframe[3] | (pframe[4] << 8) | ((uint32_t)pframe[5] << 16) | ((uint32_t)pframe[6] << 24);
+	uint32_t brr;
+	uint8_t over8;
+
+	if (uart3_baud_fallback && baud == uart3_baud) {
+		uart3_baud_fallback = 0;			// probe made it, keep the new rate
+		uart3_baud_reply(UART_BAUD_CONFIRMED, baud);
+		return;
+	}
+	if (uart3_brr(baud, &brr, &over8)) {
+		uart3_baud_reply(UART_BAUD_NACK, baud);
+		return;
+	}
+
+	uart3_baud_reply(UART_BAUD_ACK, baud);
+	uint32_t previous = uart3_baud_fallback ? uart3_baud_fallback : uart3_baud; // a switch before the probe falls back to the last confirmed rate
+	uart3_set_baud(baud);
+	uart3_baud_fallback = previous;
+	uart3_baud_deadline = HAL_GetTick() + UART_BAUD_PROBE_MS;
+
+}
+
+// Half transfer hands the first half of the chunk back to the producers
+// early; transfer complete frees the rest and starts the next chunk.
+void DMA1_Ch4_7_DMA2_Ch3_5_IRQHandler(void) {
+
+	uint32_t isr = DMA1->ISR;
+
+	if (isr & DMA_ISR_GIF6) {
+		DMA1->IFCR = DMA_IFCR_CGIF6;
+		uart3_rx_collect(0);
+	}
+
+	if (isr & DMA_ISR_GIF7) {
+		DMA1->IFCR = DMA_IFCR_CGIF7;
+		uart3_tx_tail = uart3_tx_dma_start + (uart3_tx_dma_len - DMA1_Channel7->CNDTR);
+		if (isr & (DMA_ISR_TCIF7 | DMA_ISR_TEIF7)) {
+			if (isr & DMA_ISR_TEIF7) {
+				uart3_tx_tail = uart3_tx_dma_start + uart3_tx_dma_len;	// bus error, skip the chunk
+			}
+			DMA1_Channel7->CCR = 0;
+			uart3_tx_dma_len = 0;
+			uart3_tx_kick();
+		}
 	}
 
 }